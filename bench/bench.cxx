@@ -0,0 +1,407 @@
+// Benchmark harness. Runs works made by gen_ugoira.py through each pipeline mode and reports per-phase latency and throughput.
+// Requests that would go to pixiv are sent to server.py instead. See bench/run.sh.
+
+#include <ugconv/ugconv.hpp>
+#include <ugconv/scheduler.hpp>
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <string_view>
+#include <map>
+#include <thread>
+#include <atomic>
+#include <array>
+#include <optional>
+
+namespace fs = std::filesystem;
+using nlohmann::json;
+
+namespace {
+	// Sends everything to the local server, keeping only the path of the original URL.
+	struct local_requester final : ugconv::requester {
+		local_requester(std::string base) : base(std::move(base)) {}
+		
+		ugconv::response get(std::string_view url, const ugconv::request_opts &opts) override {
+			auto host = url.find("://");
+			auto path = url.find('/', host == url.npos ? 0 : host + 3);
+			
+			return inner.get(base + std::string{url.substr(path == url.npos ? url.size() : path)}, opts);
+		}
+		
+	private:
+		ugconv::curl inner;
+		std::string base;
+	};
+	
+	struct work {
+		uint64_t id;
+		fs::path meta;
+		fs::path zip;
+		fs::path ugoira;
+		std::string zip_data;
+	};
+	
+	struct bench_opts {
+		std::string server = "http://127.0.0.1:8642";
+		fs::path data;
+		fs::path out;
+		std::vector<std::string> modes = {"url", "meta", "zip", "memory", "ugoira"};
+		ugconv::format fmt = ugconv::FMT_WEBM;
+		unsigned jobs = 1;
+		unsigned runs = 1;
+		// Use a manifest in the output directory for url mode.
+		bool incremental = false;
+		bool revalidate = false;
+		// Network, extract and encode workers. Given, jobs go through a scheduler instead of -j contexts.
+		std::optional<std::array<unsigned, ugconv::STAGE_DONE>> stages;
+	};
+	
+	std::vector<work> find_works(const fs::path &data) {
+		std::map<uint64_t, work> works;
+		
+		for (auto &ent : fs::directory_iterator{data}) {
+			auto name = ent.path().filename().string();
+			auto id = ugconv::chars_to_int<uint64_t>(std::string_view{name}.substr(0, name.find_first_of("_.")));
+			
+			if (!id) {
+				continue;
+			}
+			
+			auto &w = works[*id];
+			w.id = *id;
+			
+			if (name.ends_with("_meta.json")) {
+				w.meta = ent.path();
+			}
+			else if (name.ends_with(".zip")) {
+				w.zip = ent.path();
+			}
+			else if (name.ends_with(".ugoira")) {
+				w.ugoira = ent.path();
+			}
+		}
+		
+		std::vector<work> out;
+		
+		for (auto &[id, w] : works) {
+			if (!w.meta.empty() && !w.zip.empty() && !w.ugoira.empty()) {
+				std::ifstream in{w.zip, std::ios::binary};
+				w.zip_data.assign(std::istreambuf_iterator<char>{in}, {});
+				out.push_back(std::move(w));
+			}
+		}
+		
+		return out;
+	}
+	
+	// Gives a context or convert_job the inputs of mode.
+	ugconv::result set_inputs(auto &target, const work &w, std::string_view mode) {
+		if (mode == "url") {
+			target.set_post(w.id);
+		}
+		else if (mode == "meta" || mode == "zip" || mode == "memory") {
+			if (auto res = target.set_meta(w.meta); !res) {
+				return res;
+			}
+			
+			if (mode == "zip") {
+				target.set_zip(w.zip);
+			}
+			else if (mode == "memory") {
+				target.set_zip(std::as_bytes(std::span{w.zip_data}));
+			}
+		}
+		else if (mode == "ugoira") {
+			target.set_ugoira(w.ugoira);
+		}
+		
+		return {};
+	}
+	
+	ugconv::result run_one(ugconv::context &ctx, const work &w, std::string_view mode, const fs::path &dest, ugconv::format fmt) {
+		if (auto res = set_inputs(ctx, w, mode); !res) {
+			ctx.clear_params();
+			return res;
+		}
+		
+		return ctx.convert(dest, fmt);
+	}
+	
+	// Incremental runs share one output per work, since that's what the manifest keeps track of. Otherwise outputs are numbered by n, so the same work can be in flight more than once.
+	fs::path output_path(const bench_opts &opts, const work &w, size_t n, bool incremental) {
+		auto name = std::to_string(w.id);
+		
+		if (!incremental) {
+			name += '-' + std::to_string(n);
+		}
+		
+		return opts.out / (name + '.' + std::string{ugconv::extension(opts.fmt)});
+	}
+	
+	// Runs the jobs through a scheduler. Returns how busy each stage was on average, as a fraction of its workers.
+	json run_scheduled(const bench_opts &opts, const std::vector<work> &works, const std::string &mode, size_t total, ugconv::manifest *index, ugconv::metrics_aggregate &totals) {
+		auto &counts = *opts.stages;
+		
+		ugconv::scheduler_opts sopts;
+		sopts.network_workers = counts[ugconv::STAGE_NETWORK];
+		sopts.extract_workers = counts[ugconv::STAGE_EXTRACT];
+		sopts.encode_workers = counts[ugconv::STAGE_ENCODE];
+		
+		sopts.make_requester = [&] {
+			return std::make_unique<local_requester>(opts.server);
+		};
+		
+		sopts.configure = [&](ugconv::context &ctx) noexcept {
+			if (index) {
+				ctx.set_manifest(index, opts.revalidate);
+			}
+		};
+		
+		ugconv::scheduler sched{std::move(sopts)};
+		std::array<double, ugconv::STAGE_DONE> busy{};
+		size_t samples = 0;
+		std::atomic<bool> sampling = true;
+		
+		std::thread sampler{[&] {
+			while (sampling) {
+				for (int st = 0; st < ugconv::STAGE_DONE; st++) {
+					busy[st] += sched.busy(ugconv::stage(st));
+				}
+				
+				samples++;
+				std::this_thread::sleep_for(std::chrono::milliseconds{2});
+			}
+		}};
+		
+		for (size_t i = 0; i < total; i++) {
+			auto &w = works[i % works.size()];
+			ugconv::convert_job j;
+			j.dest = output_path(opts, w, i / works.size(), index != nullptr);
+			j.fmt = opts.fmt;
+			
+			if (auto res = set_inputs(j, w, mode); !res) {
+				std::cerr << mode << ": " << w.id << ": " << res.message << '\n';
+				totals.add({}, res);
+				continue;
+			}
+			
+			sched.submit(std::move(j), [&, id = w.id](ugconv::convert_job &j) {
+				if (!j.res) {
+					std::cerr << mode << ": " << id << ": " << j.res.message << '\n';
+				}
+				
+				if (j.res.up_to_date) {
+					totals.add_skipped();
+				}
+				else {
+					totals.add(j.metrics, j.res);
+				}
+			});
+		}
+		
+		sched.wait();
+		sampling = false;
+		sampler.join();
+		
+		static constexpr std::string_view names[] = {"network", "extract", "encode"};
+		json out;
+		
+		for (int st = 0; st < ugconv::STAGE_DONE; st++) {
+			out[names[st]] = {
+				{"workers", counts[st]},
+				{"busy", samples ? busy[st] / samples / counts[st] : 0},
+			};
+		}
+		
+		return out;
+	}
+	
+	json run_mode(const bench_opts &opts, const std::vector<work> &works, const std::string &mode) {
+		ugconv::metrics_aggregate totals;
+		ugconv::manifest index;
+		std::atomic<size_t> next = 0;
+		size_t total = works.size() * opts.runs;
+		uint64_t input_bytes = 0;
+		
+		for (auto &w : works) {
+			input_bytes += w.zip_data.size() * opts.runs;
+		}
+		
+		bool incremental = mode == "url" && (opts.incremental || opts.revalidate);
+		
+		if (incremental) {
+			index.open(opts.out / ugconv::manifest::default_name);
+		}
+		
+		auto start = std::chrono::steady_clock::now();
+		std::vector<std::thread> threads;
+		json stages;
+		
+		if (opts.stages) {
+			stages = run_scheduled(opts, works, mode, total, incremental ? &index : nullptr, totals);
+		}
+		
+		for (unsigned t = 0; t < (opts.stages ? 0 : opts.jobs); t++) {
+			threads.emplace_back([&, t] {
+				local_requester req{opts.server};
+				ugconv::context ctx{req};
+				ctx.show_progress(false);
+				
+				if (incremental) {
+					ctx.set_manifest(&index, opts.revalidate);
+				}
+				
+				for (size_t i; (i = next++) < total;) {
+					auto &w = works[i % works.size()];
+					auto dest = output_path(opts, w, t, incremental);
+					auto res = run_one(ctx, w, mode, dest, opts.fmt);
+					
+					if (!res) {
+						std::cerr << mode << ": " << w.id << ": " << res.message << '\n';
+					}
+					
+					if (res.up_to_date) {
+						totals.add_skipped();
+					}
+					else {
+						totals.add(ctx.metrics(), res);
+					}
+				}
+			});
+		}
+		
+		for (auto &t : threads) {
+			t.join();
+		}
+		
+		double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		
+		json out = {
+			{"mode", mode},
+			{"format", ugconv::extension(opts.fmt)},
+			{"concurrency", opts.jobs},
+			{"jobs", total},
+			{"wall_s", secs},
+			{"jobs_per_s", total / secs},
+			{"input_mb_per_s", input_bytes / secs / 1e6},
+			{"metrics", totals.to_json()},
+		};
+		
+		if (opts.stages) {
+			out.erase("concurrency");
+			out["stages"] = std::move(stages);
+		}
+		
+		return out;
+	}
+	
+	void usage() {
+		std::cout << "ugconv-bench -data <DIR> [-server <URL>] [-out <DIR>] [-mode <url|meta|zip|memory|ugoira>]... [-fmt <webm|gif>] [-j <N> | -stages <NET>,<EXTRACT>,<ENCODE>] [-runs <N>] [-incremental] [-revalidate]\n";
+		exit(1);
+	}
+}
+
+int main(int argc, char **argv) {
+	bench_opts opts;
+	bool modes_given = false;
+	// Not thread-safe, and every -j thread makes its own curl handle at once.
+	curl_global_init(CURL_GLOBAL_DEFAULT);
+	
+	for (int i = 1; i < argc; i++) {
+		std::string_view arg = argv[i];
+		
+		if (arg == "-incremental" || arg == "-revalidate") {
+			(arg == "-incremental" ? opts.incremental : opts.revalidate) = true;
+			continue;
+		}
+		
+		if (i == argc - 1) {
+			usage();
+		}
+		
+		std::string_view val = argv[++i];
+		
+		if (arg == "-data") {
+			opts.data = val;
+		}
+		else if (arg == "-server") {
+			opts.server = val;
+		}
+		else if (arg == "-out") {
+			opts.out = val;
+		}
+		else if (arg == "-mode") {
+			if (!modes_given) {
+				opts.modes.clear();
+				modes_given = true;
+			}
+			
+			opts.modes.emplace_back(val);
+		}
+		else if (arg == "-fmt") {
+			auto fmt = ugconv::parse_format(val);
+			
+			if (!fmt) {
+				usage();
+			}
+			
+			opts.fmt = *fmt;
+		}
+		else if (arg == "-stages") {
+			auto &counts = opts.stages.emplace();
+			
+			for (int st = 0; st < ugconv::STAGE_DONE; st++) {
+				auto comma = val.find(',');
+				auto n = ugconv::chars_to_int<unsigned>(val.substr(0, comma));
+				
+				// Exactly three counts, all non-zero.
+				if (!n || !*n || (st < ugconv::STAGE_DONE - 1) == (comma == val.npos)) {
+					usage();
+				}
+				
+				counts[st] = *n;
+				val.remove_prefix(comma == val.npos ? val.size() : comma + 1);
+			}
+		}
+		else if (arg == "-j" || arg == "-runs") {
+			auto n = ugconv::chars_to_int<unsigned>(val);
+			
+			if (!n || !*n) {
+				usage();
+			}
+			
+			(arg == "-j" ? opts.jobs : opts.runs) = *n;
+		}
+		else {
+			usage();
+		}
+	}
+	
+	if (opts.data.empty()) {
+		usage();
+	}
+	
+	for (auto &mode : opts.modes) {
+		if (mode != "url" && mode != "meta" && mode != "zip" && mode != "memory" && mode != "ugoira") {
+			usage();
+		}
+	}
+	
+	if (opts.out.empty()) {
+		opts.out = fs::temp_directory_path() / "ugconv-bench";
+	}
+	
+	fs::create_directories(opts.out);
+	
+	auto works = find_works(opts.data);
+	
+	if (works.empty()) {
+		std::cout << "No works found in " << opts.data << '\n';
+		return 1;
+	}
+	
+	for (auto &mode : opts.modes) {
+		std::cout << run_mode(opts, works, mode).dump() << std::endl;
+	}
+}
@@ -0,0 +1,155 @@
+#!/usr/bin/env python3
+"""Generate synthetic ugoira for benchmarking.
+
+For every work this writes, into the output directory:
+    <id>_ugoira<W>x<H>.zip  the frames, as served by i.pximg.net
+    <id>_meta.json          ugoira_meta as returned by the pixiv ajax API (wrapped in "body")
+    <id>.ugoira             PixivUtil2-style zip with the frames plus animation.json
+
+PNG frames are encoded here. JPEG frames need either Pillow or ffmpeg.
+"""
+
+import argparse
+import io
+import json
+import os
+import random
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+import zipfile
+import zlib
+
+
+def png_bytes(w, h, pixels):
+    def chunk(tag, data):
+        c = struct.pack(">I", len(data)) + tag + data
+        return c + struct.pack(">I", zlib.crc32(tag + data) & 0xffffffff)
+
+    raw = b"".join(b"\0" + pixels[y * w * 3:(y + 1) * w * 3] for y in range(h))
+    return (b"\x89PNG\r\n\x1a\n"
+            + chunk(b"IHDR", struct.pack(">IIBBBBB", w, h, 8, 2, 0, 0, 0))
+            + chunk(b"IDAT", zlib.compress(raw, 6))
+            + chunk(b"IEND", b""))
+
+
+def frame_pixels(w, h, i, rng):
+    # A moving gradient with some noise, so encoders have real work to do but frames still compress.
+    row = bytearray(w * 3)
+    out = bytearray()
+    noise = bytes(rng.getrandbits(8) & 0x1f for _ in range(w * 3))
+
+    for y in range(h):
+        for x in range(w):
+            row[x * 3] = (x + i * 4) & 0xff
+            row[x * 3 + 1] = (y + i * 2) & 0xff
+            row[x * 3 + 2] = ((x ^ y) + i) & 0xff
+        out += bytes(a ^ b for a, b in zip(row, noise))
+
+    return bytes(out)
+
+
+def jpeg_encoder():
+    try:
+        from PIL import Image
+
+        def encode(w, h, pixels):
+            buf = io.BytesIO()
+            Image.frombytes("RGB", (w, h), pixels).save(buf, "JPEG", quality=90)
+            return buf.getvalue()
+
+        return encode
+    except ImportError:
+        pass
+
+    if shutil.which("ffmpeg"):
+        def encode(w, h, pixels):
+            return subprocess.run(
+                ["ffmpeg", "-loglevel", "error", "-f", "rawvideo", "-pix_fmt", "rgb24", "-s", f"{w}x{h}",
+                 "-i", "-", "-frames:v", "1", "-q:v", "3", "-f", "mjpeg", "-"],
+                input=pixels, stdout=subprocess.PIPE, check=True).stdout
+
+        return encode
+
+    sys.exit("JPEG frames need Pillow or ffmpeg, use --image png instead")
+
+
+def delays(n, mode, rng):
+    if mode == "constant":
+        return [60] * n
+
+    return [rng.choice([20, 40, 60, 100, 250]) for _ in range(n)]
+
+
+def zip_entry(name, compression):
+    # A fixed timestamp instead of the current time, so the same seed gives byte-identical zips (and ETags).
+    info = zipfile.ZipInfo(name, date_time=(1980, 1, 1, 0, 0, 0))
+    info.compress_type = compression
+    info.external_attr = 0o644 << 16
+    return info
+
+
+def generate(args, post_id, rng, encode_jpeg):
+    ext = "jpg" if args.image == "jpeg" else "png"
+    compression = zipfile.ZIP_STORED if args.zip == "stored" else zipfile.ZIP_DEFLATED
+    frames = []
+    zip_buf = io.BytesIO()
+
+    with zipfile.ZipFile(zip_buf, "w", compression) as z:
+        for i, delay in enumerate(delays(args.frames, args.delays, rng)):
+            pixels = frame_pixels(args.width, args.height, i, rng)
+            data = encode_jpeg(args.width, args.height, pixels) if ext == "jpg" else png_bytes(args.width, args.height, pixels)
+            name = f"{i:06d}.{ext}"
+            z.writestr(zip_entry(name, compression), data)
+            frames.append({"file": name, "delay": delay})
+
+    zip_name = f"{post_id}_ugoira{args.width}x{args.height}.zip"
+    meta = {
+        "src": f"https://i.pximg.net/img-zip-ugoira/img/{post_id}_ugoira600x600.zip",
+        "originalSrc": f"https://i.pximg.net/img-zip-ugoira/img/{zip_name}",
+        "mime_type": "image/jpeg" if ext == "jpg" else "image/png",
+        "frames": frames,
+    }
+
+    with open(os.path.join(args.out, zip_name), "wb") as f:
+        f.write(zip_buf.getvalue())
+
+    with open(os.path.join(args.out, f"{post_id}_meta.json"), "w") as f:
+        json.dump({"error": False, "message": "", "body": meta}, f)
+
+    # PixivUtil2 puts the frames and an animation.json (the unwrapped meta) in the same zip.
+    with zipfile.ZipFile(zip_buf, "a", compression) as z:
+        z.writestr(zip_entry("animation.json", compression), json.dumps(meta))
+
+    with open(os.path.join(args.out, f"{post_id}.ugoira"), "wb") as f:
+        f.write(zip_buf.getvalue())
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    p.add_argument("--out", required=True, help="output directory")
+    p.add_argument("--count", type=int, default=1, help="number of works")
+    p.add_argument("--first-id", type=int, default=1000, help="post ID of the first work, the rest count up from it")
+    p.add_argument("--frames", type=int, default=30)
+    p.add_argument("--width", type=int, default=320)
+    p.add_argument("--height", type=int, default=240)
+    p.add_argument("--image", choices=["jpeg", "png"], default="jpeg")
+    p.add_argument("--delays", choices=["constant", "variable"], default="constant")
+    p.add_argument("--zip", choices=["stored", "deflated"], default="stored", help="pixiv serves stored zips")
+    p.add_argument("--seed", type=int, default=1, help="same seed and options give the same output")
+    args = p.parse_args()
+
+    os.makedirs(args.out, exist_ok=True)
+    rng = random.Random(args.seed)
+    encode_jpeg = jpeg_encoder() if args.image == "jpeg" else None
+
+    for post_id in range(args.first_id, args.first_id + args.count):
+        generate(args, post_id, rng, encode_jpeg)
+
+    print(f"Generated {args.count} works in {args.out}")
+
+
+if __name__ == "__main__":
+    main()
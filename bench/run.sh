@@ -0,0 +1,33 @@
+#!/bin/sh
+# Generates a synthetic data set (once), starts the local pixiv stand-in, and runs the harness against it.
+# Arguments are passed to the harness, e.g. bench/run.sh -mode url -j 4 -runs 3
+#
+# Environment:
+#   BENCH_DATA       data set directory (default build/bench-data), generated if it doesn't exist
+#   BENCH_GEN_ARGS   arguments for gen_ugoira.py when generating, e.g. "--count 20 --frames 60 --image png"
+#   BENCH_PORT       server port (default 8642)
+#   BENCH_LATENCY    server latency per response in ms (default 0)
+#   BENCH_BANDWIDTH  server bandwidth per response in bytes/s (default 0, unlimited)
+#   BENCH_BIN        harness binary (default build/ugconv-bench)
+
+set -e
+
+dir=$(dirname "$0")
+data=${BENCH_DATA:-build/bench-data}
+port=${BENCH_PORT:-8642}
+
+if [ ! -d "$data" ]; then
+	python3 "$dir/gen_ugoira.py" --out "$data" ${BENCH_GEN_ARGS:---count 8}
+fi
+
+python3 "$dir/server.py" --data "$data" --port "$port" --latency "${BENCH_LATENCY:-0}" --bandwidth "${BENCH_BANDWIDTH:-0}" &
+server=$!
+trap 'kill $server' EXIT
+
+# Wait for the server to come up.
+for i in $(seq 50); do
+	python3 -c "import socket; socket.create_connection(('127.0.0.1', $port))" 2>/dev/null && break
+	sleep 0.1
+done
+
+"${BENCH_BIN:-build/ugconv-bench}" -data "$data" -server "http://127.0.0.1:$port" "$@"
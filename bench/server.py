@@ -0,0 +1,126 @@
+#!/usr/bin/env python3
+"""Local stand-in for pixiv, serving works made by gen_ugoira.py.
+
+    GET /ajax/illust/<id>/ugoira_meta    -> <data>/<id>_meta.json
+    GET /img-zip-ugoira/img/<name>.zip   -> <data>/<name>.zip
+
+Unknown IDs get the same {"error": true, ...} body pixiv returns, and zips carry an ETag and honour
+If-None-Match. --latency delays the start of every response and --bandwidth caps each response's
+transfer rate, to approximate a real connection.
+"""
+
+import argparse
+import hashlib
+import json
+import os
+import re
+import time
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+META_RE = re.compile(r"^/ajax/illust/(\d+)/ugoira_meta$")
+ZIP_RE = re.compile(r"^/img-zip-ugoira/img/([\w.-]+\.zip)$")
+
+
+class handler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def do_GET(self):
+        path = self.path.split("?", 1)[0]
+
+        if m := META_RE.match(path):
+            file = os.path.join(self.server.data, f"{m.group(1)}_meta.json")
+
+            if not os.path.exists(file):
+                body = json.dumps({"error": True, "message": "Work not found", "body": []}).encode()
+                return self.respond(404, "application/json", body)
+
+            return self.respond(200, "application/json", self.read(file))
+
+        if m := ZIP_RE.match(path):
+            file = os.path.join(self.server.data, m.group(1))
+
+            if not os.path.exists(file):
+                return self.respond(404, "text/plain", b"Not found")
+
+            # From the contents rather than the mtime, so regenerating the data with the same seed keeps manifests valid.
+            body = self.read(file)
+            etag = f'"{hashlib.sha1(body).hexdigest()}"'
+
+            if self.headers.get("If-None-Match") == etag:
+                return self.respond(304, None, b"", etag)
+
+            return self.respond(200, "application/zip", body, etag)
+
+        self.respond(404, "text/plain", b"Not found")
+
+    @staticmethod
+    def read(file):
+        with open(file, "rb") as f:
+            return f.read()
+
+    def respond(self, code, ctype, body, etag=None):
+        if self.server.latency:
+            time.sleep(self.server.latency)
+
+        self.send_response(code)
+
+        if ctype:
+            self.send_header("Content-Type", ctype)
+
+        if etag:
+            self.send_header("ETag", etag)
+
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+
+        if not self.server.bandwidth:
+            self.wfile.write(body)
+            return
+
+        # Send in 10ms worth of bytes at a time.
+        chunk = max(1, self.server.bandwidth // 100)
+        start = time.monotonic()
+
+        for off in range(0, len(body), chunk):
+            try:
+                self.wfile.write(body[off:off + chunk])
+            except (BrokenPipeError, ConnectionResetError):
+                # The client gave up on a slow transfer.
+                return
+
+            ahead = (off + chunk) / self.server.bandwidth - (time.monotonic() - start)
+
+            if ahead > 0:
+                time.sleep(ahead)
+
+    def log_message(self, fmt, *args):
+        if self.server.verbose:
+            super().log_message(fmt, *args)
+
+
+def main():
+    p = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    p.add_argument("--data", required=True, help="directory written by gen_ugoira.py")
+    p.add_argument("--port", type=int, default=8642)
+    p.add_argument("--latency", type=float, default=0, help="milliseconds before each response")
+    p.add_argument("--bandwidth", type=int, default=0, help="bytes per second per response, 0 for unlimited")
+    p.add_argument("-v", dest="verbose", action="store_true", help="log requests")
+    args = p.parse_args()
+
+    server = ThreadingHTTPServer(("127.0.0.1", args.port), handler)
+    server.data = args.data
+    server.latency = args.latency / 1000
+    server.bandwidth = args.bandwidth
+    server.verbose = args.verbose
+    server.daemon_threads = True
+
+    print(f"Serving {args.data} on http://127.0.0.1:{args.port}", flush=True)
+
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,195 @@
+#pragma once
+
+#include <vector>
+#include <set>
+#include <optional>
+#include <functional>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <stdint.h>
+#include <sched.h>
+
+namespace ugconv {
+	struct cpu_budget;
+	
+	// CPUs handed to one encode by a cpu_budget. Given back when destroyed.
+	struct cpu_lease {
+		cpu_lease() = default;
+		
+		cpu_lease(cpu_lease &&o) noexcept : budget(o.budget), cpu_list(std::move(o.cpu_list)) {
+			o.budget = nullptr;
+		}
+		
+		cpu_lease &operator=(cpu_lease &&o) noexcept {
+			if (this != &o) {
+				release();
+				budget = o.budget;
+				cpu_list = std::move(o.cpu_list);
+				o.budget = nullptr;
+			}
+			
+			return *this;
+		}
+		
+		unsigned threads() const {
+			return cpu_list.size();
+		}
+		
+		const std::vector<int> &cpus() const {
+			return cpu_list;
+		}
+		
+		~cpu_lease() {
+			release();
+		}
+		
+	private:
+		friend struct cpu_budget;
+		
+		inline void release();
+		
+		cpu_budget *budget = nullptr;
+		std::vector<int> cpu_list;
+	};
+	
+	// A process-wide pool of CPUs shared by every context registered with it (see context::set_cpu_budget).
+	// Each encode leases some CPUs and passes that many threads to ffmpeg. When every CPU is leased, encodes queue up in FIFO order.
+	// Leases are sized by load: a lone job gets up to max_per_job CPUs, while under contention each job gets its fair share of what's free, down to one.
+	struct cpu_budget {
+		// cpus == 0 means every CPU this process may run on.
+		explicit cpu_budget(unsigned cpus = 0, unsigned max_per_job = 4) : max_per_job(std::max(1u, max_per_job)) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			
+			if (sched_getaffinity(0, sizeof set, &set) == 0) {
+				for (int i = 0; i < CPU_SETSIZE; i++) {
+					if (CPU_ISSET(i, &set)) {
+						cpu_ids.push_back(i);
+					}
+				}
+			}
+			
+			if (cpu_ids.empty()) {
+				cpu_ids.push_back(0);
+			}
+			
+			if (cpus && cpus < cpu_ids.size()) {
+				cpu_ids.resize(cpus);
+			}
+			
+			used.resize(cpu_ids.size());
+			free_count = cpu_ids.size();
+		}
+		
+		cpu_budget(const cpu_budget&) = delete;
+		cpu_budget &operator=(const cpu_budget&) = delete;
+		
+		// Blocks until at least one CPU is free and every earlier caller has been served.
+		cpu_lease acquire() {
+			return *acquire({});
+		}
+		
+		// Like acquire, but polls stop about every 100ms while waiting, and gives up its place in line once it returns true.
+		std::optional<cpu_lease> acquire(const std::function<bool()> &stop) {
+			std::unique_lock lk{mtx};
+			
+			auto ticket = next_ticket++;
+			auto ready = [&] { return ticket == serving && free_count > 0; };
+			
+			if (!stop) {
+				cv.wait(lk, ready);
+			}
+			else {
+				while (!cv.wait_for(lk, std::chrono::milliseconds{100}, ready)) {
+					if (stop()) {
+						abandoned.insert(ticket);
+						skip_abandoned();
+						lk.unlock();
+						cv.notify_all();
+						return {};
+					}
+				}
+			}
+			
+			serving++;
+			skip_abandoned();
+			
+			// Everyone still queued behind us will want a share of what's left too.
+			auto waiting = unsigned(next_ticket - serving - abandoned.size());
+			auto n = std::clamp(free_count / (waiting + 1), 1u, max_per_job);
+			
+			cpu_lease lease;
+			lease.budget = this;
+			
+			for (size_t i = 0; i < used.size() && lease.cpu_list.size() < n; i++) {
+				if (!used[i]) {
+					used[i] = true;
+					lease.cpu_list.push_back(cpu_ids[i]);
+				}
+			}
+			
+			free_count -= n;
+			lk.unlock();
+			
+			// The next in line might be able to go as well.
+			cv.notify_all();
+			
+			return lease;
+		}
+		
+		unsigned size() const {
+			return cpu_ids.size();
+		}
+		
+		// If set, encoders are pinned to the CPUs they were leased.
+		bool pin = false;
+		// Niceness applied to encoder processes, 0 leaves it unchanged.
+		int nice = 0;
+		
+	private:
+		friend struct cpu_lease;
+		
+		// Tickets of callers that gave up waiting are passed over when their turn comes.
+		void skip_abandoned() {
+			while (abandoned.erase(serving)) {
+				serving++;
+			}
+		}
+		
+		void release(const std::vector<int> &cpus) {
+			{
+				std::lock_guard lk{mtx};
+				
+				for (int cpu : cpus) {
+					auto i = std::find(cpu_ids.begin(), cpu_ids.end(), cpu) - cpu_ids.begin();
+					used[i] = false;
+				}
+				
+				free_count += cpus.size();
+			}
+			
+			cv.notify_all();
+		}
+		
+		unsigned max_per_job;
+		std::vector<int> cpu_ids;
+		std::vector<bool> used;
+		unsigned free_count = 0;
+		
+		std::mutex mtx;
+		std::condition_variable cv;
+		uint64_t next_ticket = 0;
+		uint64_t serving = 0;
+		std::set<uint64_t> abandoned;
+	};
+	
+	inline void cpu_lease::release() {
+		if (budget) {
+			budget->release(cpu_list);
+			budget = nullptr;
+			cpu_list.clear();
+		}
+	}
+}
@@ -3,6 +3,7 @@
 #include <memory>
 #include <curl/curl.h>
 #include <assert.h>
+#include <strings.h>
 
 namespace ugconv {
 	struct curl final : requester {
@@ -24,12 +25,31 @@ namespace ugconv {
 			curl_easy_setopt(ctx, CURLOPT_NOPROGRESS, 0);
 			curl_easy_setopt(ctx, CURLOPT_XFERINFOFUNCTION, progressfunction);
 			curl_easy_setopt(ctx, CURLOPT_XFERINFODATA, &opts);
+			curl_easy_setopt(ctx, CURLOPT_HEADERFUNCTION, headerfunction);
+			curl_easy_setopt(ctx, CURLOPT_HEADERDATA, &resp);
+			curl_easy_setopt(ctx, CURLOPT_TIMEOUT_MS, long(opts.timeout.count()));
+			curl_easy_setopt(ctx, CURLOPT_LOW_SPEED_LIMIT, opts.low_speed_limit);
+			curl_easy_setopt(ctx, CURLOPT_LOW_SPEED_TIME, long(opts.low_speed_time.count()));
+			
+			curl_slist *headers = nullptr;
+			
+			if (!opts.if_none_match.empty()) {
+				headers = curl_slist_append(headers, ("If-None-Match: " + std::string{opts.if_none_match}).c_str());
+			}
+			
+			// Always set, so headers from a previous request on this handle don't stick around.
+			curl_easy_setopt(ctx, CURLOPT_HTTPHEADER, headers);
 			
 			auto err = curl_easy_perform(ctx);
 			
+			curl_easy_setopt(ctx, CURLOPT_HTTPHEADER, nullptr);
+			curl_slist_free_all(headers);
+			
 			curl_easy_getinfo(ctx, CURLINFO_RESPONSE_CODE, &resp.code);
 			
+			// A transfer that broke off after the headers (e.g. aborted, or too slow) would otherwise look like a success with a truncated body.
 			if (err != CURLE_OK) {
+				resp.code = 0;
 				resp.message = errbuf.get();
 			}
 			
@@ -53,6 +73,27 @@ namespace ugconv {
 			return sz;
 		}
 		
+		static size_t headerfunction(const char *p, size_t, size_t sz, void *ud) {
+			auto &resp = *static_cast<response*>(ud);
+			std::string_view line{p, sz};
+			
+			if (line.size() > 5 && strncasecmp(p, "etag:", 5) == 0) {
+				line.remove_prefix(5);
+				
+				while (!line.empty() && (line.front() == ' ' || line.front() == '\t')) {
+					line.remove_prefix(1);
+				}
+				
+				while (!line.empty() && (line.back() == '\r' || line.back() == '\n' || line.back() == ' ')) {
+					line.remove_suffix(1);
+				}
+				
+				resp.etag = line;
+			}
+			
+			return sz;
+		}
+		
 		static int progressfunction(void *p, curl_off_t total, curl_off_t now, curl_off_t, curl_off_t) {
 			auto &ro = *reinterpret_cast<request_opts*>(p);
 			
@@ -60,7 +101,8 @@ namespace ugconv {
 				ro.progressfn(total, now);
 			}
 			
-			return 0;
+			// Nonzero makes curl fail the transfer with CURLE_ABORTED_BY_CALLBACK.
+			return ro.abortfn && ro.abortfn();
 		}
 		
 		CURL *ctx;
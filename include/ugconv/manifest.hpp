@@ -0,0 +1,122 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <optional>
+#include <fstream>
+#include <filesystem>
+#include <mutex>
+#include <stdint.h>
+#include <nlohmann/json.hpp>
+
+namespace ugconv {
+	// What a post was last converted from, and how.
+	struct manifest_entry {
+		uint64_t id = 0;
+		// Output file name, relative to the directory of the manifest.
+		std::string file;
+		std::string zip_url;
+		std::string etag;
+		uint64_t delay_hash = 0;
+		std::string format;
+		std::string settings;
+	};
+	
+	// Index of converted posts kept next to the outputs, so re-runs can skip posts that haven't changed (see context::set_manifest).
+	// Stored as one JSON object per line, appended to as posts are converted. Later lines override earlier ones for the same post and format.
+	// Thread-safe, one manifest can be shared by contexts writing into the same directory.
+	struct manifest {
+		static constexpr std::string_view default_name = ".ugoira-convert.index";
+		
+		// Reads the manifest if it exists and opens it for appending. Compacts the file if it's mostly overridden lines.
+		bool open(const std::filesystem::path &path) {
+			std::lock_guard lk{mtx};
+			
+			entries.clear();
+			size_t lines = 0;
+			
+			if (std::ifstream in{path}) {
+				for (std::string line; std::getline(in, line);) {
+					try {
+						auto j = nlohmann::json::parse(line);
+						
+						manifest_entry e;
+						j.at("id").get_to(e.id);
+						j.at("file").get_to(e.file);
+						j.at("zip_url").get_to(e.zip_url);
+						j.at("etag").get_to(e.etag);
+						j.at("delay_hash").get_to(e.delay_hash);
+						j.at("format").get_to(e.format);
+						j.at("settings").get_to(e.settings);
+						
+						entries[key(e.id, e.format)] = std::move(e);
+						lines++;
+					}
+					catch (...) {
+						// A line cut short by a crash, skip it.
+					}
+				}
+			}
+			
+			if (lines > 2 * entries.size() + 64) {
+				auto tmp = path;
+				tmp += ".tmp";
+				
+				{
+					std::ofstream out{tmp, std::ios::trunc};
+					
+					for (const auto &[k, e] : entries) {
+						out << to_json(e).dump() << '\n';
+					}
+				}
+				
+				std::filesystem::rename(tmp, path);
+			}
+			
+			out.close();
+			out.open(path, std::ios::app);
+			return bool(out);
+		}
+		
+		std::optional<manifest_entry> find(uint64_t id, std::string_view format) const {
+			std::lock_guard lk{mtx};
+			
+			auto iter = entries.find(key(id, format));
+			
+			if (iter == entries.end()) {
+				return {};
+			}
+			
+			return iter->second;
+		}
+		
+		void record(manifest_entry e) {
+			std::lock_guard lk{mtx};
+			
+			out << to_json(e).dump() << '\n' << std::flush;
+			entries[key(e.id, e.format)] = std::move(e);
+		}
+		
+	private:
+		static std::string key(uint64_t id, std::string_view format) {
+			return std::to_string(id) + ':' + std::string{format};
+		}
+		
+		static nlohmann::json to_json(const manifest_entry &e) {
+			return {
+				{"id", e.id},
+				{"file", e.file},
+				{"zip_url", e.zip_url},
+				{"etag", e.etag},
+				{"delay_hash", e.delay_hash},
+				{"format", e.format},
+				{"settings", e.settings},
+			};
+		}
+		
+		mutable std::mutex mtx;
+		std::unordered_map<std::string, manifest_entry> entries;
+		std::ofstream out;
+	};
+}
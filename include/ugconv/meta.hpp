@@ -0,0 +1,238 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <stdint.h>
+#include <nlohmann/json.hpp>
+
+namespace ugconv {
+	// The parts of an ugoira_meta.json that convert needs, read straight from the JSON text without building a DOM.
+	// Frame names are stored back to back in one buffer, so a meta costs a handful of allocations however many frames it has, and none at all when a meta_info is reused.
+	struct meta_info {
+		struct frame {
+			uint32_t name_off = 0;
+			uint32_t name_len = 0;
+			int delay = 0;
+		};
+		
+		std::string zip_url;
+		std::vector<frame> frames;
+		// From the wrapper pixiv puts around the meta. Error responses have error set and the reason in message.
+		bool error = false;
+		std::string message;
+		// False if fields are missing or have the wrong types, or there are no frames.
+		bool valid = false;
+		
+		std::string_view name(const frame &f) const {
+			return std::string_view{names}.substr(f.name_off, f.name_len);
+		}
+		
+		// Empties it, keeping the buffers.
+		void clear() {
+			zip_url.clear();
+			frames.clear();
+			names.clear();
+			error = false;
+			message.clear();
+			valid = false;
+		}
+		
+		// Replaces the contents with the meta read from in (anything nlohmann::json::sax_parse accepts).
+		// Both the pixiv response, {"error": ..., "message": ..., "body": {meta}}, and the bare meta PixivUtil2 saves are accepted.
+		// Returns the error if in isn't valid JSON. Otherwise check valid.
+		template <typename Input>
+		std::optional<std::string> parse(Input &&in) {
+			clear();
+			
+			sax handler{*this};
+			
+			if (!nlohmann::json::sax_parse(std::forward<Input>(in), &handler)) {
+				clear();
+				return std::move(handler.parse_err);
+			}
+			
+			valid = handler.have_zip_url && handler.have_frames && !handler.bad_frame && !frames.empty();
+			return {};
+		}
+		
+	private:
+		// Tracks where in the document we are with a stack of container kinds, and only looks at values in the places the meta fields live.
+		struct sax {
+			using json = nlohmann::json;
+			
+			enum kind {
+				OTHER,
+				ROOT,
+				BODY,
+				FRAMES,
+				FRAME,
+			};
+			
+			sax(meta_info &mi) : mi(mi) {}
+			
+			// The meta is either the root itself or its body. Once a body object turns up it wins over anything at the root.
+			bool in_meta() const {
+				return stack.back() == BODY || (stack.back() == ROOT && !have_body);
+			}
+			
+			bool start_object(size_t) {
+				if (stack.empty()) {
+					stack.push_back(ROOT);
+				}
+				else if (stack.back() == ROOT && cur_key == "body") {
+					stack.push_back(BODY);
+				}
+				else if (stack.back() == FRAMES) {
+					mi.frames.emplace_back();
+					have_file = have_delay = false;
+					stack.push_back(FRAME);
+				}
+				else {
+					stack.push_back(OTHER);
+				}
+				
+				return true;
+			}
+			
+			bool end_object() {
+				if (stack.back() == FRAME && !(have_file && have_delay)) {
+					bad_frame = true;
+				}
+				
+				stack.pop_back();
+				return true;
+			}
+			
+			bool start_array(size_t) {
+				non_object();
+				
+				if (!stack.empty() && in_meta() && cur_key == "frames") {
+					mi.frames.clear();
+					mi.names.clear();
+					have_frames = true;
+					stack.push_back(FRAMES);
+				}
+				else {
+					stack.push_back(OTHER);
+				}
+				
+				return true;
+			}
+			
+			bool end_array() {
+				stack.pop_back();
+				return true;
+			}
+			
+			bool key(json::string_t &k) {
+				cur_key.assign(k);
+				
+				// Whatever its value, a body key means the root isn't the meta. If it's not an object, nothing is.
+				if (stack.back() == ROOT && cur_key == "body") {
+					mi.zip_url.clear();
+					mi.frames.clear();
+					mi.names.clear();
+					have_zip_url = have_frames = bad_frame = false;
+					have_body = true;
+				}
+				
+				return true;
+			}
+			
+			bool string(json::string_t &s) {
+				non_object();
+				
+				if (stack.empty()) {
+					return true;
+				}
+				
+				if (stack.back() == FRAME && cur_key == "file") {
+					auto &f = mi.frames.back();
+					f.name_off = mi.names.size();
+					mi.names += s;
+					f.name_len = s.size();
+					have_file = true;
+				}
+				else if (in_meta() && cur_key == "originalSrc") {
+					mi.zip_url.assign(s);
+					have_zip_url = true;
+				}
+				else if (stack.back() == ROOT && cur_key == "message") {
+					mi.message.assign(s);
+				}
+				
+				return true;
+			}
+			
+			bool number_integer(json::number_integer_t n) {
+				return delay(n);
+			}
+			
+			bool number_unsigned(json::number_unsigned_t n) {
+				return delay(n);
+			}
+			
+			bool number_float(json::number_float_t n, const json::string_t&) {
+				return delay(n);
+			}
+			
+			bool boolean(bool b) {
+				non_object();
+				
+				if (!stack.empty() && stack.back() == ROOT && cur_key == "error") {
+					mi.error = b;
+				}
+				
+				return true;
+			}
+			
+			bool null() {
+				non_object();
+				return true;
+			}
+			
+			bool binary(json::binary_t&) {
+				non_object();
+				return true;
+			}
+			
+			bool parse_error(size_t, const std::string&, const nlohmann::detail::exception &e) {
+				parse_err = e.what();
+				return false;
+			}
+			
+			bool delay(auto n) {
+				non_object();
+				
+				if (!stack.empty() && stack.back() == FRAME && cur_key == "delay") {
+					mi.frames.back().delay = int(n);
+					have_delay = true;
+				}
+				
+				return true;
+			}
+			
+			// Called for every value that isn't an object. Frames have to be.
+			void non_object() {
+				if (!stack.empty() && stack.back() == FRAMES) {
+					bad_frame = true;
+				}
+			}
+			
+			meta_info &mi;
+			std::vector<kind> stack;
+			std::string cur_key;
+			std::string parse_err;
+			bool have_body = false;
+			bool have_zip_url = false;
+			bool have_frames = false;
+			bool bad_frame = false;
+			bool have_file = false;
+			bool have_delay = false;
+		};
+		
+		std::string names;
+	};
+}
@@ -0,0 +1,253 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <string_view>
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <nlohmann/json.hpp>
+
+namespace ugconv {
+	enum phase {
+		PHASE_META,   // fetching ugoira_meta from pixiv
+		PHASE_ZIP,    // fetching the zip from pixiv
+		PHASE_UNZIP,  // extracting frames
+		PHASE_ENCODE, // running ffmpeg
+		PHASE_COUNT,
+	};
+	
+	enum phase_event {
+		PHASE_BEGIN,
+		PHASE_END,
+	};
+	
+	constexpr std::string_view phase_name(phase ph) {
+		switch (ph) {
+			case PHASE_META:
+				return "meta";
+			case PHASE_ZIP:
+				return "zip";
+			case PHASE_UNZIP:
+				return "unzip";
+			case PHASE_ENCODE:
+				return "encode";
+			case PHASE_COUNT:
+				break;
+		}
+		
+		assert(false);
+	}
+	
+	using duration = std::chrono::nanoseconds;
+	
+	// Resource usage of the child processes (unzip, ffmpeg) run during a phase.
+	struct child_usage {
+		duration user{};
+		duration sys{};
+		long max_rss_kb = 0;
+		
+		void add(const rusage &ru) {
+			user += to_duration(ru.ru_utime);
+			sys += to_duration(ru.ru_stime);
+			max_rss_kb = std::max(max_rss_kb, ru.ru_maxrss);
+		}
+		
+	private:
+		static duration to_duration(timeval tv) {
+			return std::chrono::seconds{tv.tv_sec} + std::chrono::microseconds{tv.tv_usec};
+		}
+	};
+	
+	struct phase_stats {
+		bool ran = false;
+		duration wall{};
+		// CPU time of the thread running the conversion, not including children.
+		duration cpu{};
+		// Bytes downloaded for PHASE_META/PHASE_ZIP, size of the zip for PHASE_UNZIP.
+		uint64_t bytes = 0;
+		child_usage child;
+	};
+	
+	struct job_metrics {
+		duration wall{};
+		std::array<phase_stats, PHASE_COUNT> phases;
+	};
+	
+	// Called at the beginning and end of every phase. On PHASE_BEGIN the stats are all zero.
+	using instrument_function = void(phase, phase_event, const phase_stats&);
+	
+	inline duration thread_cpu_time() {
+		timespec ts;
+		clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+		return std::chrono::seconds{ts.tv_sec} + std::chrono::nanoseconds{ts.tv_nsec};
+	}
+	
+	inline double to_ms(duration d) {
+		return std::chrono::duration<double, std::milli>(d).count();
+	}
+	
+	inline nlohmann::json to_json(const phase_stats &ps) {
+		return {
+			{"wall_ms", to_ms(ps.wall)},
+			{"cpu_ms", to_ms(ps.cpu)},
+			{"bytes", ps.bytes},
+			{"child_user_ms", to_ms(ps.child.user)},
+			{"child_sys_ms", to_ms(ps.child.sys)},
+			{"child_max_rss_kb", ps.child.max_rss_kb},
+		};
+	}
+	
+	inline nlohmann::json to_json(const job_metrics &jm) {
+		nlohmann::json phases = nlohmann::json::object();
+		
+		for (int i = 0; i < PHASE_COUNT; i++) {
+			if (jm.phases[i].ran) {
+				phases[std::string{phase_name(phase(i))}] = to_json(jm.phases[i]);
+			}
+		}
+		
+		return {{"wall_ms", to_ms(jm.wall)}, {"phases", std::move(phases)}};
+	}
+	
+	// Latency histogram with power-of-two millisecond buckets: bucket i counts latencies below 2^i ms, the last bucket is everything else.
+	struct latency_histogram {
+		static constexpr int buckets = 24;
+		
+		void add(duration d) {
+			auto ms = uint64_t(std::chrono::duration_cast<std::chrono::milliseconds>(d).count());
+			int i = 0;
+			
+			while (i < buckets - 1 && ms >= (uint64_t(1) << i)) {
+				i++;
+			}
+			
+			counts[i]++;
+			count++;
+			sum += d;
+			max = std::max(max, d);
+		}
+		
+		// Upper bound of the bucket containing the given quantile, in ms.
+		double quantile(double q) const {
+			if (!count) {
+				return 0;
+			}
+			
+			uint64_t target = uint64_t(q * count);
+			uint64_t seen = 0;
+			
+			for (int i = 0; i < buckets - 1; i++) {
+				seen += counts[i];
+				
+				if (seen > target) {
+					return double(uint64_t(1) << i);
+				}
+			}
+			
+			return to_ms(max);
+		}
+		
+		nlohmann::json to_json() const {
+			nlohmann::json hist = nlohmann::json::array();
+			
+			for (int i = 0; i < buckets; i++) {
+				if (counts[i]) {
+					auto le = i < buckets - 1 ? nlohmann::json(uint64_t(1) << i) : nlohmann::json("inf");
+					hist.push_back({{"lt_ms", le}, {"count", counts[i]}});
+				}
+			}
+			
+			return {
+				{"count", count},
+				{"mean_ms", count ? to_ms(sum) / count : 0},
+				{"max_ms", to_ms(max)},
+				{"p50_ms", quantile(.5)},
+				{"p90_ms", quantile(.9)},
+				{"p99_ms", quantile(.99)},
+				{"buckets", std::move(hist)},
+			};
+		}
+		
+		std::array<uint64_t, buckets> counts{};
+		uint64_t count = 0;
+		duration sum{};
+		duration max{};
+	};
+	
+	// Totals over many jobs, for batch and daemon use. Thread-safe.
+	struct metrics_aggregate {
+		void add(const job_metrics &jm, bool ok) {
+			std::lock_guard lk{mtx};
+			
+			(ok ? jobs_ok : jobs_failed)++;
+			total.add(jm.wall);
+			
+			for (int i = 0; i < PHASE_COUNT; i++) {
+				auto &ps = jm.phases[i];
+				
+				if (!ps.ran) {
+					continue;
+				}
+				
+				auto &agg = phases[i];
+				agg.latency.add(ps.wall);
+				agg.cpu += ps.cpu;
+				agg.child_cpu += ps.child.user + ps.child.sys;
+				agg.bytes += ps.bytes;
+			}
+		}
+		
+		// For jobs that didn't need doing, kept out of the latency figures.
+		void add_skipped() {
+			std::lock_guard lk{mtx};
+			jobs_skipped++;
+		}
+		
+		nlohmann::json to_json() const {
+			std::lock_guard lk{mtx};
+			
+			nlohmann::json ph = nlohmann::json::object();
+			
+			for (int i = 0; i < PHASE_COUNT; i++) {
+				auto &agg = phases[i];
+				
+				if (!agg.latency.count) {
+					continue;
+				}
+				
+				ph[std::string{phase_name(phase(i))}] = {
+					{"latency", agg.latency.to_json()},
+					{"cpu_ms", to_ms(agg.cpu)},
+					{"child_cpu_ms", to_ms(agg.child_cpu)},
+					{"bytes", agg.bytes},
+				};
+			}
+			
+			return {
+				{"jobs_ok", jobs_ok},
+				{"jobs_failed", jobs_failed},
+				{"jobs_skipped", jobs_skipped},
+				{"latency", total.to_json()},
+				{"phases", std::move(ph)},
+			};
+		}
+		
+	private:
+		struct phase_aggregate {
+			latency_histogram latency;
+			duration cpu{};
+			duration child_cpu{};
+			uint64_t bytes = 0;
+		};
+		
+		mutable std::mutex mtx;
+		uint64_t jobs_ok = 0;
+		uint64_t jobs_failed = 0;
+		uint64_t jobs_skipped = 0;
+		latency_histogram total;
+		std::array<phase_aggregate, PHASE_COUNT> phases;
+	};
+}
@@ -0,0 +1,348 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+namespace ugconv {
+	struct process_opts {
+		// Written to the child's stdin, which is then closed. If empty, stdin is /dev/null.
+		std::string_view input;
+		// If false, the child writes to our stdout.
+		bool capture_stdout = false;
+		// The child is killed once this much time has passed. Zero means no limit.
+		std::chrono::milliseconds timeout{0};
+		// Extra descriptors the child should inherit under the same number, e.g. for /proc/self/fd/N paths.
+		std::vector<int> inherit_fds;
+		// If not empty, the child is restricted to these CPUs.
+		std::vector<int> cpus;
+		// Niceness to give the child, 0 leaves it unchanged.
+		int nice = 0;
+		// Polled about every 100ms while the child runs. The child is killed once it returns true.
+		std::function<bool()> cancelfn;
+	};
+	
+	struct process_result {
+		// False if the process couldn't be spawned at all, in which case err holds the reason.
+		bool started = false;
+		int exit_code = -1;
+		// Set if the child was terminated by a signal.
+		int signal = 0;
+		bool timed_out = false;
+		// Set if the child was killed because cancelfn returned true.
+		bool cancelled = false;
+		std::string out;
+		// Only the last max_stderr bytes are kept.
+		std::string err;
+		rusage usage{};
+		
+		static constexpr size_t max_stderr = 64 * 1024;
+		
+		bool ok() const {
+			return started && signal == 0 && exit_code == 0;
+		}
+	};
+	
+	// Quotes argv for display so it can be pasted into a shell.
+	inline std::string shell_quote(const std::vector<std::string> &argv) {
+		std::string out;
+		
+		for (const auto &arg : argv) {
+			if (!out.empty()) {
+				out += ' ';
+			}
+			
+			if (!arg.empty() && arg.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_./=:,+") == arg.npos) {
+				out += arg;
+				continue;
+			}
+			
+			out += '\'';
+			
+			for (char c : arg) {
+				if (c == '\'') {
+					out += "'\\''";
+				}
+				else {
+					out += c;
+				}
+			}
+			
+			out += '\'';
+		}
+		
+		return out;
+	}
+	
+	// Runs argv[0] (searched for in PATH) directly, without a shell, and waits for it.
+	inline process_result run_process(const std::vector<std::string> &argv, const process_opts &opts = {}) {
+		process_result res;
+		
+		if (argv.empty()) {
+			res.err = "empty command";
+			return res;
+		}
+		
+		std::vector<char*> cargv;
+		
+		for (const auto &a : argv) {
+			cargv.push_back(const_cast<char*>(a.c_str()));
+		}
+		
+		cargv.push_back(nullptr);
+		
+		// [0] is read end, [1] is write end. All are close-on-exec, the child only gets the dup2'd copies.
+		int in_pipe[2] = {-1, -1}, out_pipe[2] = {-1, -1}, err_pipe[2] = {-1, -1};
+		
+		auto close_all = [&] {
+			for (int fd : {in_pipe[0], in_pipe[1], out_pipe[0], out_pipe[1], err_pipe[0], err_pipe[1]}) {
+				if (fd >= 0) {
+					close(fd);
+				}
+			}
+		};
+		
+		if ((!opts.input.empty() && pipe2(in_pipe, O_CLOEXEC) != 0) ||
+		    (opts.capture_stdout && pipe2(out_pipe, O_CLOEXEC) != 0) ||
+		    pipe2(err_pipe, O_CLOEXEC) != 0) {
+			res.err = "pipe: " + std::string{strerror(errno)};
+			close_all();
+			return res;
+		}
+		
+		posix_spawn_file_actions_t fa;
+		posix_spawn_file_actions_init(&fa);
+		
+		if (in_pipe[0] >= 0) {
+			posix_spawn_file_actions_adddup2(&fa, in_pipe[0], STDIN_FILENO);
+		}
+		else {
+			posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+		}
+		
+		if (out_pipe[1] >= 0) {
+			posix_spawn_file_actions_adddup2(&fa, out_pipe[1], STDOUT_FILENO);
+		}
+		
+		posix_spawn_file_actions_adddup2(&fa, err_pipe[1], STDERR_FILENO);
+		
+		// dup2 onto itself clears close-on-exec.
+		for (int fd : opts.inherit_fds) {
+			posix_spawn_file_actions_adddup2(&fa, fd, fd);
+		}
+		
+		// The caller may have signals blocked (e.g. to handle them on a dedicated thread), the child shouldn't inherit that.
+		posix_spawnattr_t attr;
+		posix_spawnattr_init(&attr);
+		sigset_t no_sigs;
+		sigemptyset(&no_sigs);
+		posix_spawnattr_setsigmask(&attr, &no_sigs);
+		posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+		
+		pid_t pid;
+		int err = posix_spawnp(&pid, cargv[0], &fa, &attr, cargv.data(), environ);
+		posix_spawn_file_actions_destroy(&fa);
+		posix_spawnattr_destroy(&attr);
+		
+		// Only the parent's ends stay open here.
+		for (int *fd : {&in_pipe[0], &out_pipe[1], &err_pipe[1]}) {
+			if (*fd >= 0) {
+				close(*fd);
+				*fd = -1;
+			}
+		}
+		
+		if (err != 0) {
+			res.err = argv[0] + ": " + strerror(err);
+			close_all();
+			return res;
+		}
+		
+		res.started = true;
+		
+		// posix_spawn has no way to set these up front, so they're applied right after. Threads the child starts from here on inherit them.
+		if (!opts.cpus.empty()) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			
+			for (int cpu : opts.cpus) {
+				CPU_SET(cpu, &set);
+			}
+			
+			sched_setaffinity(pid, sizeof set, &set);
+		}
+		
+		if (opts.nice) {
+			setpriority(PRIO_PROCESS, pid, opts.nice);
+		}
+		
+		// A child that exits without reading all its input would otherwise kill us with SIGPIPE.
+		sigset_t pipe_set, old_set;
+		sigemptyset(&pipe_set);
+		sigaddset(&pipe_set, SIGPIPE);
+		pthread_sigmask(SIG_BLOCK, &pipe_set, &old_set);
+		
+		if (in_pipe[1] >= 0) {
+			fcntl(in_pipe[1], F_SETFL, O_NONBLOCK);
+		}
+		
+		auto deadline = std::chrono::steady_clock::now() + opts.timeout;
+		size_t input_off = 0;
+		bool got_sigpipe = false;
+		char buf[16384];
+		int status = 0;
+		bool reaped = false;
+		
+		for (;;) {
+			bool pipes_open = in_pipe[1] >= 0 || out_pipe[0] >= 0 || err_pipe[0] >= 0;
+			
+			// The child can close its output and keep running, so the timeout and cancelfn still apply until it has exited.
+			if (!pipes_open) {
+				pid_t r = wait4(pid, &status, WNOHANG, &res.usage);
+				
+				if (r == pid) {
+					reaped = true;
+					break;
+				}
+				
+				if ((r < 0 && errno != EINTR) || (!opts.timeout.count() && !opts.cancelfn)) {
+					break;
+				}
+			}
+			
+			pollfd fds[3];
+			int nfds = 0;
+			
+			for (int fd : {in_pipe[1], out_pipe[0], err_pipe[0]}) {
+				if (fd >= 0) {
+					fds[nfds++] = {fd, short(fd == in_pipe[1] ? POLLOUT : POLLIN), 0};
+				}
+			}
+			
+			int wait_ms = -1;
+			
+			if (opts.timeout.count()) {
+				auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+				
+				if (left.count() <= 0) {
+					res.timed_out = true;
+					kill(pid, SIGKILL);
+					break;
+				}
+				
+				wait_ms = int(std::min<long long>(left.count(), 1000 * 60));
+			}
+			
+			if (opts.cancelfn) {
+				if (opts.cancelfn()) {
+					res.cancelled = true;
+					kill(pid, SIGKILL);
+					break;
+				}
+				
+				wait_ms = wait_ms < 0 ? 100 : std::min(wait_ms, 100);
+			}
+			
+			// Nothing to wake us up when it exits, check back soon.
+			if (!pipes_open) {
+				wait_ms = wait_ms < 0 ? 10 : std::min(wait_ms, 10);
+			}
+			
+			if (poll(fds, nfds, wait_ms) < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				
+				kill(pid, SIGKILL);
+				break;
+			}
+			
+			for (int i = 0; i < nfds; i++) {
+				if (!fds[i].revents) {
+					continue;
+				}
+				
+				int fd = fds[i].fd;
+				
+				if (fd == in_pipe[1]) {
+					auto n = write(fd, opts.input.data() + input_off, opts.input.size() - input_off);
+					
+					if (n > 0) {
+						input_off += n;
+					}
+					else if (n < 0 && errno == EPIPE) {
+						got_sigpipe = true;
+					}
+					
+					if (input_off == opts.input.size() || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+						close(fd);
+						in_pipe[1] = -1;
+					}
+					
+					continue;
+				}
+				
+				auto n = read(fd, buf, sizeof buf);
+				
+				if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+					continue;
+				}
+				
+				if (n <= 0) {
+					close(fd);
+					(fd == out_pipe[0] ? out_pipe[0] : err_pipe[0]) = -1;
+					continue;
+				}
+				
+				if (fd == out_pipe[0]) {
+					res.out.append(buf, n);
+				}
+				else {
+					res.err.append(buf, n);
+					
+					if (res.err.size() > 2 * process_result::max_stderr) {
+						res.err.erase(0, res.err.size() - process_result::max_stderr);
+					}
+				}
+			}
+		}
+		
+		close_all();
+		
+		while (!reaped && wait4(pid, &status, 0, &res.usage) < 0 && errno == EINTR) {}
+		
+		if (WIFEXITED(status)) {
+			res.exit_code = WEXITSTATUS(status);
+		}
+		else if (WIFSIGNALED(status)) {
+			res.signal = WTERMSIG(status);
+		}
+		
+		if (res.err.size() > process_result::max_stderr) {
+			res.err.erase(0, res.err.size() - process_result::max_stderr);
+		}
+		
+		if (got_sigpipe) {
+			timespec zero{};
+			sigtimedwait(&pipe_set, nullptr, &zero);
+		}
+		
+		pthread_sigmask(SIG_SETMASK, &old_set, nullptr);
+		
+		return res;
+	}
+}
@@ -3,12 +3,15 @@
 #include <string>
 #include <string_view>
 #include <functional>
+#include <chrono>
 
 namespace ugconv {
 	struct response {
 		long code = 0;
 		std::string message;
 		std::string body;
+		// Value of the ETag header, if the server sent one.
+		std::string etag;
 	};
 	
 	struct request_opts {
@@ -17,6 +20,15 @@ namespace ugconv {
 		std::string_view cookies;
 		// if total isn't known, total should be set to 0.
 		std::function<void(off_t total, off_t now)> progressfn;
+		// If not empty, sent as If-None-Match. The server then answers 304 with no body if the resource still has this ETag.
+		std::string_view if_none_match;
+		// Polled throughout the transfer, at least about once a second even if it's stalled. The transfer is aborted once it returns true.
+		std::function<bool()> abortfn;
+		// The transfer is aborted once it has taken this long. Zero means no limit.
+		std::chrono::milliseconds timeout{0};
+		// The transfer is aborted if it averages less than low_speed_limit bytes per second for low_speed_time. Zero means no limit.
+		long low_speed_limit = 0;
+		std::chrono::seconds low_speed_time{0};
 	};
 	
 	struct requester {
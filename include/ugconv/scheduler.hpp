@@ -0,0 +1,246 @@
+#pragma once
+
+#include <ugconv/ugconv.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace ugconv {
+	// FIFO between two stages. push blocks while it's full, which is what holds back the stage in front of a slow one.
+	template <typename T>
+	struct bounded_queue {
+		explicit bounded_queue(size_t cap) : cap(std::max<size_t>(cap, 1)) {}
+		
+		// Returns false, leaving x alone, if the queue was closed.
+		bool push(T &&x) {
+			std::unique_lock lk{mtx};
+			
+			not_full.wait(lk, [this] {
+				return closed || items.size() < cap;
+			});
+			
+			if (closed) {
+				return false;
+			}
+			
+			items.push_back(std::move(x));
+			not_empty.notify_one();
+			return true;
+		}
+		
+		// Waits for an item. Empty once the queue is closed and everything in it has been taken.
+		std::optional<T> pop() {
+			std::unique_lock lk{mtx};
+			
+			not_empty.wait(lk, [this] {
+				return closed || !items.empty();
+			});
+			
+			if (items.empty()) {
+				return {};
+			}
+			
+			T x = std::move(items.front());
+			items.pop_front();
+			not_full.notify_one();
+			return x;
+		}
+		
+		void close() {
+			std::lock_guard lk{mtx};
+			closed = true;
+			not_full.notify_all();
+			not_empty.notify_all();
+		}
+		
+		size_t size() const {
+			std::lock_guard lk{mtx};
+			return items.size();
+		}
+		
+	private:
+		size_t cap;
+		std::deque<T> items;
+		bool closed = false;
+		mutable std::mutex mtx;
+		std::condition_variable not_full;
+		std::condition_variable not_empty;
+	};
+	
+	struct scheduler_opts {
+		// Workers per stage, each with its own context. Network workers spend most of their time waiting on pixiv, so there can be many more of them than cores.
+		// Encode workers are what keeps the CPU busy, size them to the cores (or to a cpu_budget, see configure).
+		unsigned network_workers = 16;
+		unsigned extract_workers = 2;
+		unsigned encode_workers = std::max(1u, std::thread::hardware_concurrency());
+		// Jobs that can wait in front of each stage. Downloaded zips are held in memory until they're extracted, so this also bounds that memory.
+		size_t queue_size = 16;
+		// Makes the requester of each worker's context. Without one, they use curl.
+		std::function<std::unique_ptr<requester>()> make_requester;
+		// Called on each worker's context before it starts, to set the user agent, session ID, deadlines, manifest and so on. All contexts must be set up the same.
+		// Anything it hands out is shared between the workers: one cpu_budget for the encoders, one scratch_pool, one manifest.
+		// Workers start together, so it's called from all of their threads at once and must be thread-safe. The same goes for make_requester.
+		std::function<void(context&)> configure;
+	};
+	
+	// Runs jobs through the stages with a separate set of workers for each, connected by bounded queues.
+	// A job is on one stage at a time, so downloads for later jobs overlap with the extraction and encoding of earlier ones, and each stage can be saturated at once.
+	// When a stage falls behind its queue fills up, and the stage before it waits, back to submit.
+	struct scheduler {
+		// Called from a worker thread once a job is done, with j.res and j.metrics filled in. Has to be thread-safe.
+		using done_function = void(convert_job &j);
+		
+		explicit scheduler(scheduler_opts opts = {}) : opts(std::move(opts)) {
+#ifndef UGCONV_NO_CURL
+			// Not thread-safe, and would otherwise be done implicitly by the first of many workers to create a curl handle at the same time.
+			curl_global_init(CURL_GLOBAL_DEFAULT);
+#endif
+			
+			unsigned counts[] = {this->opts.network_workers, this->opts.extract_workers, this->opts.encode_workers};
+			
+			for (auto &q : queues) {
+				q = std::make_unique<bounded_queue<std::unique_ptr<entry>>>(this->opts.queue_size);
+			}
+			
+			for (int st = 0; st < STAGE_DONE; st++) {
+				// Every stage needs at least one worker, or jobs sent to it would never finish.
+				for (unsigned i = 0; i < std::max(counts[st], 1u); i++) {
+					workers[st].emplace_back([this, st] {
+						work(stage(st));
+					});
+				}
+			}
+		}
+		
+		scheduler(const scheduler&) = delete;
+		scheduler &operator=(const scheduler&) = delete;
+		
+		// Queues j for the first stage it needs. Blocks while that stage's queue is full.
+		// Memory the job was given (set_zip and set_ugoira spans) must stay valid until done is called.
+		void submit(convert_job j, std::function<done_function> done = {}) {
+			auto e = std::make_unique<entry>(std::move(j), std::move(done));
+			auto st = e->job.first_stage();
+			
+			{
+				std::lock_guard lk{idle_mtx};
+				pending++;
+			}
+			
+			if (!queues[st]->push(std::move(e))) {
+				abandon(std::move(e));
+			}
+		}
+		
+		// Blocks until every job submitted so far is done.
+		void wait() {
+			std::unique_lock lk{idle_mtx};
+			
+			idle.wait(lk, [this] {
+				return pending == 0;
+			});
+		}
+		
+		// Jobs waiting in front of stage st.
+		size_t queued(stage st) const {
+			return queues[st]->size();
+		}
+		
+		// Workers of stage st working on a job right now, as opposed to waiting for one or for room in the next queue.
+		unsigned busy(stage st) const {
+			return busy_count[st];
+		}
+		
+		// Finishes the jobs already submitted, then stops the workers. Stop the jobs' stop tokens first to get there sooner.
+		~scheduler() {
+			// One stage at a time, so nothing is ever pushed into a queue that's already closed.
+			for (int st = 0; st < STAGE_DONE; st++) {
+				queues[st]->close();
+				
+				for (auto &t : workers[st]) {
+					t.join();
+				}
+			}
+		}
+		
+	private:
+		struct entry {
+			entry(convert_job j, std::function<done_function> done) : job(std::move(j)), done(std::move(done)) {}
+			
+			convert_job job;
+			std::function<done_function> done;
+		};
+		
+		void work(stage st) {
+			std::unique_ptr<requester> req;
+			std::unique_ptr<context> ctx;
+			
+			if (opts.make_requester) {
+				req = opts.make_requester();
+				ctx = std::make_unique<context>(*req);
+			}
+			else {
+				ctx = std::make_unique<context>();
+			}
+			
+			// Jobs take their scratch directory from one stage's context to the next, so the pool has to be shared even if configure doesn't set one.
+			ctx->set_scratch_pool(&scratch);
+			
+			if (opts.configure) {
+				opts.configure(*ctx);
+			}
+			
+			while (auto e = queues[st]->pop()) {
+				busy_count[st]++;
+				auto next = ctx->run_stage((*e)->job, st);
+				busy_count[st]--;
+				
+				if (next == STAGE_DONE) {
+					finish(std::move(*e));
+				}
+				else if (!queues[next]->push(std::move(*e))) {
+					abandon(std::move(*e));
+				}
+			}
+		}
+		
+		// Only if jobs are submitted while the scheduler is being destroyed.
+		void abandon(std::unique_ptr<entry> e) {
+			e->job.res = {ERR_CANCELLED, "Scheduler shut down"};
+			finish(std::move(e));
+		}
+		
+		void finish(std::unique_ptr<entry> e) {
+			if (e->done) {
+				e->done(e->job);
+			}
+			
+			// Release the job (and with it any scratch directory) before anyone waiting in wait() can go on.
+			e.reset();
+			
+			std::lock_guard lk{idle_mtx};
+			
+			if (--pending == 0) {
+				idle.notify_all();
+			}
+		}
+		
+		scheduler_opts opts;
+		scratch_pool scratch;
+		std::array<std::unique_ptr<bounded_queue<std::unique_ptr<entry>>>, STAGE_DONE> queues;
+		std::array<std::vector<std::thread>, STAGE_DONE> workers;
+		std::array<std::atomic<unsigned>, STAGE_DONE> busy_count{};
+		
+		size_t pending = 0;
+		std::mutex idle_mtx;
+		std::condition_variable idle;
+	};
+}
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <filesystem>
+#include <mutex>
+#include <random>
+#include <system_error>
+#include <stdint.h>
+
+namespace ugconv {
+	struct scratch_pool;
+	
+	// A directory leased from a scratch_pool for the duration of one conversion. Emptied and given back when destroyed.
+	struct scratch_lease {
+		scratch_lease() = default;
+		
+		scratch_lease(scratch_lease &&o) noexcept : pool(o.pool), dir(std::move(o.dir)), bytes(o.bytes), on_fallback(o.on_fallback) {
+			o.pool = nullptr;
+		}
+		
+		scratch_lease &operator=(scratch_lease &&o) noexcept {
+			if (this != &o) {
+				release();
+				pool = o.pool;
+				dir = std::move(o.dir);
+				bytes = o.bytes;
+				on_fallback = o.on_fallback;
+				o.pool = nullptr;
+			}
+			
+			return *this;
+		}
+		
+		// False if the pool couldn't create a directory.
+		explicit operator bool () const {
+			return pool != nullptr;
+		}
+		
+		const std::filesystem::path &path() const {
+			return dir;
+		}
+		
+		// True if the work was too big for the pool's cap and was put in the fallback directory.
+		bool spilled() const {
+			return on_fallback;
+		}
+		
+		~scratch_lease() {
+			release();
+		}
+		
+	private:
+		friend struct scratch_pool;
+		
+		inline void release();
+		
+		scratch_pool *pool = nullptr;
+		std::filesystem::path dir;
+		uint64_t bytes = 0;
+		bool on_fallback = false;
+	};
+	
+	// Scratch directories for extracted frames, created once and reused from one conversion to the next instead of making and removing a fresh temp dir every time.
+	// root is meant to be memory-backed, e.g. /dev/shm. cap limits how many bytes of frames can be leased from it at once, and works that would go over are given a directory under fallback instead. cap == 0 means no limit.
+	// Thread-safe, one pool can serve every context in a process. Leases must not outlive the pool.
+	struct scratch_pool {
+		explicit scratch_pool(std::filesystem::path root = std::filesystem::temp_directory_path(), uint64_t cap = 0, std::filesystem::path fallback = std::filesystem::temp_directory_path()) : cap(cap) {
+			primary.root = std::move(root);
+			secondary.root = std::move(fallback);
+		}
+		
+		scratch_pool(const scratch_pool&) = delete;
+		scratch_pool &operator=(const scratch_pool&) = delete;
+		
+		// bytes is what will be extracted into the directory. Returns an empty lease if no directory could be created.
+		scratch_lease acquire(uint64_t bytes) {
+			std::lock_guard lk{mtx};
+			
+			bool spill = cap && used + bytes > cap;
+			auto &a = spill ? secondary : primary;
+			
+			scratch_lease lease;
+			lease.bytes = spill ? 0 : bytes;
+			lease.on_fallback = spill;
+			used += lease.bytes;
+			
+			std::error_code ec;
+			
+			if (!a.free.empty()) {
+				lease.dir = std::move(a.free.back());
+				a.free.pop_back();
+			}
+			else if (a.base.empty()) {
+				a.base = make_base(a.root, ec);
+			}
+			
+			if (!ec && lease.dir.empty()) {
+				lease.dir = a.base / std::to_string(a.next++);
+			}
+			
+			// Also for reused slots: something like tmpfiles cleanup may have removed the whole tree while the pool sat idle.
+			if (!ec) {
+				std::filesystem::create_directories(lease.dir, ec);
+			}
+			
+			if (ec) {
+				used -= lease.bytes;
+				return {};
+			}
+			
+			lease.pool = this;
+			return lease;
+		}
+		
+		// Bytes currently leased from root.
+		uint64_t in_use() const {
+			std::lock_guard lk{mtx};
+			return used;
+		}
+		
+		~scratch_pool() {
+			std::error_code ec;
+			
+			for (auto *a : {&primary, &secondary}) {
+				if (!a->base.empty()) {
+					std::filesystem::remove_all(a->base, ec);
+				}
+			}
+		}
+		
+	private:
+		friend struct scratch_lease;
+		
+		struct area {
+			std::filesystem::path root;
+			// Directory of this pool's slots under root, created on first use.
+			std::filesystem::path base;
+			std::vector<std::filesystem::path> free;
+			unsigned next = 0;
+		};
+		
+		// <root>/ugoira-convert/<random>, so pools in different processes don't collide.
+		static std::filesystem::path make_base(const std::filesystem::path &root, std::error_code &ec) {
+			static constexpr std::string_view chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ1234567890";
+			
+			auto parent = root / "ugoira-convert";
+			std::filesystem::create_directories(parent, ec);
+			
+			if (ec) {
+				return {};
+			}
+			
+			std::mt19937 rng{std::random_device{}()};
+			std::uniform_int_distribution distr{size_t(0), chars.size() - 1};
+			
+			for (;;) {
+				std::string name(32, ' ');
+				
+				for (auto &c : name) {
+					c = chars[distr(rng)];
+				}
+				
+				auto base = parent / name;
+				
+				if (std::filesystem::create_directory(base, ec)) {
+					return base;
+				}
+				
+				if (ec) {
+					return {};
+				}
+			}
+		}
+		
+		void give_back(std::filesystem::path dir, uint64_t bytes, bool on_fallback) {
+			std::lock_guard lk{mtx};
+			used -= bytes;
+			(on_fallback ? secondary : primary).free.push_back(std::move(dir));
+		}
+		
+		uint64_t cap;
+		uint64_t used = 0;
+		area primary;
+		area secondary;
+		mutable std::mutex mtx;
+	};
+	
+	inline void scratch_lease::release() {
+		if (!pool) {
+			return;
+		}
+		
+		// Emptied here rather than by the pool, so it happens outside the pool's lock.
+		std::error_code ec, rm_ec;
+		
+		for (auto iter = std::filesystem::directory_iterator{dir, ec}; !ec && iter != std::filesystem::directory_iterator{}; iter.increment(ec)) {
+			std::filesystem::remove_all(iter->path(), rm_ec);
+		}
+		
+		pool->give_back(std::move(dir), bytes, on_fallback);
+		pool = nullptr;
+	}
+}
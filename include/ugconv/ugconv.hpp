@@ -6,14 +6,28 @@
 #include <string_view>
 #include <string>
 #include <filesystem>
-#include <random>
 #include <optional>
 #include <memory>
 #include <charconv>
+#include <span>
+#include <variant>
+#include <array>
+#include <stop_token>
 #include <assert.h>
 #include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <nlohmann/json.hpp>
 #include <ugconv/request.hpp>
+#include <ugconv/zip.hpp>
+#include <ugconv/metrics.hpp>
+#include <ugconv/process.hpp>
+#include <ugconv/budget.hpp>
+#include <ugconv/manifest.hpp>
+#include <ugconv/meta.hpp>
+#include <ugconv/scratch.hpp>
 
 #ifndef UGCONV_NO_CURL
 #include <ugconv/curl.hpp>
@@ -32,11 +46,15 @@ namespace ugconv {
 		ERR_META_INVALID,
 		ERR_REQ_FAILED,
 		ERR_URL_INVALID,
+		ERR_CANCELLED,
+		ERR_TIMEOUT,
 	};
 	
 	struct result {
 		errcode err = ERR_OK;
 		std::string message;
+		// Set if convert skipped the post because the manifest says its output is current.
+		bool up_to_date = false;
 		
 		constexpr operator bool () const {
 			return err == ERR_OK;
@@ -59,6 +77,11 @@ namespace ugconv {
 	// At the end of a PROG_BAR sequence, a PROG_MESSAGE with msg.empty() == true will be sent.
 	using progress_function = void(progress_type, std::string msg, off_t bytes_total, off_t bytes_now);
 	
+	inline constexpr std::string_view default_user_agent = "Mozilla/5.0 (X11; Linux x86_64; rv:91.0) Gecko/20100101 Firefox/91.0";
+	
+	// A zip (or .ugoira) either on disk, or already in memory. Memory buffers are not copied, the caller must keep them alive until convert returns.
+	using zip_source = std::variant<fs::path, std::span<const std::byte>>;
+	
 	inline fs::path operator+(fs::path a, std::string_view b) {
 		a += b;
 		return a;
@@ -99,6 +122,18 @@ namespace ugconv {
 		assert(false);
 	}
 	
+	// Identifies the ffmpeg settings gen_convert_cmd uses for a format. Stored in manifests, so change it whenever those settings change and old outputs will be redone.
+	constexpr std::string_view encoder_settings(format fmt) {
+		switch (fmt) {
+			case FMT_GIF:
+				return "gif:palettegen:sierra2:v1";
+			case FMT_WEBM:
+				return "webm:libvpx:b10M:crf4:v1";
+		}
+		
+		assert(false);
+	}
+	
 	constexpr std::optional<format> parse_format(std::string_view ext) {
 		if (ext == "gif") {
 			return FMT_GIF;
@@ -110,15 +145,17 @@ namespace ugconv {
 		return {};
 	}
 	
-	struct context {
-		context(requester &req) : req(&req) {}
-		
-#ifndef UGCONV_NO_CURL
-		context() : default_requester(std::make_unique<curl>()), req(default_requester.get()) {}
-#else
-		context() = default;
-#endif
-		
+	// Stages a conversion goes through, see context::run_stage. Each is bound by a different resource: the network, the disk (or memory) and the CPU.
+	enum stage {
+		STAGE_NETWORK, // fetching the meta and zip
+		STAGE_EXTRACT, // extracting frames, and reading the meta of .ugoira files
+		STAGE_ENCODE,  // running ffmpeg
+		STAGE_DONE,
+	};
+	
+	// One conversion: what to convert, and its state as it moves through the stages.
+	// context::convert runs one of these from start to finish, scheduler hands them from stage to stage between threads.
+	struct convert_job {
 		result set_post(std::string_view url) {
 			static constexpr std::string_view base = "www.pixiv.net/en/artworks/";
 			
@@ -153,198 +190,707 @@ namespace ugconv {
 				return {ERR_META_CANTOPEN, "Failed to open meta file: " + meta.string()};
 			}
 			
-			return set_meta(in);
+			// Read whole into a buffer that's kept between calls, parsing from a contiguous buffer is much faster than from a stream.
+			meta_buf.assign(std::istreambuf_iterator<char>{in}, {});
+			return set_meta(std::string_view{meta_buf});
 		}
 		
 		result set_meta(std::istream &meta) {
-			try {
-				param_meta = json::parse(meta);
-			}
-			catch (std::exception &e) {
-				return {ERR_META_INVALID, "Failed to parse JSON meta file: " + std::string{e.what()}};
-			}
-			
-			return {};
+			return parse_meta(meta);
+		}
+		
+		result set_meta(std::string_view meta) {
+			return parse_meta(meta);
 		}
 		
 		void set_ugoira(fs::path ugoira) {
 			param_ugoira = std::move(ugoira);
 		}
 		
-		result set_meta(std::string_view meta) {
-			try {
-				param_meta = json::parse(meta);
+		// The buffer must stay valid until the job is done.
+		void set_ugoira(std::span<const std::byte> ugoira) {
+			param_ugoira = ugoira;
+		}
+		
+		void set_zip(fs::path zip) {
+			param_zip = std::move(zip);
+		}
+		
+		// The buffer must stay valid until the job is done.
+		void set_zip(std::span<const std::byte> zip) {
+			param_zip = zip;
+		}
+		
+		auto post_id() const {
+			return param_post_id;
+		}
+		
+		// Only jobs that still need something downloaded start with STAGE_NETWORK.
+		stage first_stage() const {
+			if (param_ugoira || (have_meta && param_zip)) {
+				return STAGE_EXTRACT;
 			}
-			catch (std::exception &e) {
-				return {ERR_META_INVALID, "Failed to parse JSON meta file: " + std::string{e.what()}};
+			
+			return STAGE_NETWORK;
+		}
+		
+		// Back to an empty job, keeping the buffers.
+		void clear() {
+			param_post_id = {};
+			param_ugoira = {};
+			have_meta = false;
+			param_meta.clear();
+			param_zip = {};
+			dest.clear();
+			stop = {};
+			progressfn = {};
+			res = {};
+			metrics = {};
+			track = false;
+			prev = {};
+			etag.clear();
+			zip_body.clear();
+			work_dir = {};
+			started = {};
+		}
+		
+		fs::path dest;
+		format fmt = FMT_WEBM;
+		// Checked like context::set_stop_token's, and also before each stage.
+		std::stop_token stop;
+		std::function<progress_function> progressfn;
+		
+		// Filled in once the job is done. Phases that weren't reached have ran == false.
+		result res;
+		job_metrics metrics;
+		
+	private:
+		friend struct context;
+		
+		// Meta files fetched directly from pixiv are wrapped in more JSON containing the error code, and the actual meta file is in body.
+		// But PixivUtil2 only outputs the value of body without the wrapping JSON. meta_info::parse supports both cases.
+		result parse_meta(auto &&in) {
+			if (auto err = param_meta.parse(in)) {
+				have_meta = false;
+				return {ERR_META_INVALID, "Failed to parse JSON meta file: " + *err};
 			}
 			
+			have_meta = true;
 			return {};
 		}
 		
+		std::optional<uint64_t> param_post_id;
+		std::optional<zip_source> param_ugoira;
+		// Parsed in place, so its buffers are reused when the job is.
+		meta_info param_meta;
+		bool have_meta = false;
+		std::string meta_buf;
+		std::optional<zip_source> param_zip;
+		
+		// Only posts fetched from pixiv by ID are tracked in the manifest. prev is the entry it had, if that's still usable.
+		bool track = false;
+		std::optional<manifest_entry> prev;
+		std::string etag;
+		uint64_t hash = 0;
+		// The downloaded zip, from STAGE_NETWORK until it's extracted.
+		std::string zip_body;
+		// From STAGE_EXTRACT until the job is done.
+		scratch_lease work_dir;
+		std::chrono::steady_clock::time_point started;
+	};
+	
+	struct context {
+		context(requester &req) : req(&req) {}
+		
+#ifndef UGCONV_NO_CURL
+		context() : default_requester(std::make_unique<curl>()), req(default_requester.get()) {}
+#else
+		context() = default;
+#endif
+		
+		result set_post(std::string_view url) {
+			return pending.set_post(url);
+		}
+		
+		void set_post(uint64_t id) {
+			pending.set_post(id);
+		}
+		
+		result set_meta(const fs::path &meta) {
+			return pending.set_meta(meta);
+		}
+		
+		result set_meta(std::istream &meta) {
+			return pending.set_meta(meta);
+		}
+		
+		void set_ugoira(fs::path ugoira) {
+			pending.set_ugoira(std::move(ugoira));
+		}
+		
+		// The buffer must stay valid until convert returns.
+		void set_ugoira(std::span<const std::byte> ugoira) {
+			pending.set_ugoira(ugoira);
+		}
+		
+		result set_meta(std::string_view meta) {
+			return pending.set_meta(meta);
+		}
+		
 		void set_zip(fs::path zip) {
-			param_zip = std::move(zip);
+			pending.set_zip(std::move(zip));
+		}
+		
+		// The buffer must stay valid until convert returns.
+		void set_zip(std::span<const std::byte> zip) {
+			pending.set_zip(zip);
 		}
 		
 		result convert(const fs::path &dest, format fmt) {
-			setup_temp_dir();
+			auto &j = pending;
+			j.dest = dest;
+			j.fmt = fmt;
+			j.stop = stoken;
+			
+			if (showprogress) {
+				j.progressfn = progressfn;
+			}
 			
 			scope_guard sg = [this] {
-				teardown_temp_dir();
-				param_post_id = {};
-				param_ugoira = {};
-				param_meta = {};
-				param_zip = {};
+				last_metrics = pending.metrics;
+				pending.clear();
 			};
 			
-			bool unzipped = false;
-			auto frames_path = temp_dir / "frames";
+			for (auto st = j.first_stage(); st != STAGE_DONE; st = run_stage(j, st)) {}
 			
-			if (param_ugoira) {
-				set_zip(*param_ugoira);
-				
-				if (auto res = unzip(*param_zip, frames_path); !res) {
-					return res;
-				}
-				
-				unzipped = true;
-				auto meta_path = frames_path / "animation.json";
+			return std::move(j.res);
+		}
+		
+		// Runs stage st of j, using this context's settings, and returns the stage j needs next.
+		// Once that's STAGE_DONE, j.res and j.metrics are final and its scratch directory has been given back.
+		// Stages of one job can run on different contexts and threads, as long as the contexts are set up the same and only one works on the job at a time.
+		stage run_stage(convert_job &j, stage st) {
+			job = &j;
+			
+			scope_guard sg = [this] {
+				job = nullptr;
+			};
+			
+			if (j.started == std::chrono::steady_clock::time_point{}) {
+				j.started = std::chrono::steady_clock::now();
+			}
+			
+			stage next = STAGE_DONE;
+			
+			if (j.stop.stop_requested()) {
+				j.res = {ERR_CANCELLED, "Cancelled"};
+			}
+			else if (st == STAGE_NETWORK) {
+				next = fetch(j);
+			}
+			else if (st == STAGE_EXTRACT) {
+				next = extract(j);
+			}
+			else if (st == STAGE_ENCODE) {
+				next = encode(j);
+			}
+			
+			if (next == STAGE_DONE) {
+				j.work_dir = {};
+				std::string{}.swap(j.zip_body);
+				j.metrics.wall = std::chrono::steady_clock::now() - j.started;
+			}
+			
+			return next;
+		}
+		
+		// Forget the ID/URL, ugoira, meta and zip parameters. convert does this itself once it's done.
+		void clear_params() {
+			pending.clear();
+		}
+		
+		void set_user_agent(std::string ua) {
+			user_agent = std::move(ua);
+		}
+		
+		void set_session_id(std::string sid) {
+			session_id = std::move(sid);
+		}
+		
+		auto post_id() const {
+			return pending.post_id();
+		}
+		
+		void show_progress(bool yn) {
+			showprogress = yn;
+		}
+		
+		void set_progressfn(std::function<progress_function> fn) {
+			progressfn = std::move(fn);
+		}
+		
+		// Posts converted by ID are recorded in m, and converting a post again is skipped if m says dest is already current (result::up_to_date is set then).
+		// Normally that's decided without any requests. With revalidate, the meta is fetched and the zip is requested conditionally on its ETag, and the post is only redone if either changed.
+		// m must outlive the context. nullptr to stop using one.
+		void set_manifest(manifest *m, bool revalidate = false) {
+			index = m;
+			this->revalidate = revalidate;
+		}
+		
+		// Encodes lease their ffmpeg thread count (and optionally CPU affinity and niceness) from budget, waiting if it's exhausted.
+		// Share one budget between all contexts that run concurrently. It must outlive the context. nullptr to stop using one.
+		void set_cpu_budget(cpu_budget *budget) {
+			cpubudget = budget;
+		}
+		
+		// Once a stop is requested on st, convert aborts downloads, kills unzip and ffmpeg, cleans up and returns ERR_CANCELLED. Takes effect within about 100ms while waiting on a child process or the CPU budget, and within about a second during downloads (curl only checks that often on a stalled transfer).
+		// st stays in effect for later conversions too, so give the context a fresh one (or an empty std::stop_token) before the next.
+		void set_stop_token(std::stop_token st) {
+			stoken = std::move(st);
+		}
+		
+		// convert gives up with ERR_TIMEOUT if phase ph takes longer than limit. Zero means no limit, which is the default.
+		// Time spent waiting for the CPU budget counts towards PHASE_ENCODE.
+		void set_deadline(phase ph, std::chrono::milliseconds limit) {
+			deadlines[ph] = limit;
+		}
+		
+		// Downloads are aborted if they average less than bytes_per_sec for time, so a stalled connection fails long before any deadline. Zero means no limit.
+		void set_low_speed_limit(long bytes_per_sec, std::chrono::seconds time) {
+			low_speed_limit = bytes_per_sec;
+			low_speed_time = time;
+		}
+		
+		// Frames are extracted into directories leased from pool, which are reused between conversions. Share one pool between contexts to bound how much they extract into memory at once.
+		// Without one, the context makes its own pool in the system temp directory the first time it needs one. pool must outlive the context. nullptr to go back to the context's own.
+		void set_scratch_pool(scratch_pool *pool) {
+			scratchpool = pool;
+		}
+		
+		void set_instrumentfn(std::function<instrument_function> fn) {
+			instrumentfn = std::move(fn);
+		}
+		
+		// Timings of the most recent convert call, including failed ones. Phases that weren't reached have ran == false.
+		const job_metrics &metrics() const {
+			return last_metrics;
+		}
+		
+		bool print_commands = false;
+		
+	private:
+		// Marks a phase of the conversion for the duration of the scope.
+		struct phase_scope {
+			phase_scope(context &ctx, phase ph) : ctx(ctx), ph(ph) {
+				ctx.begin_phase(ph);
+			}
+			
+			~phase_scope() {
+				ctx.end_phase(ph, bytes);
+			}
+			
+			uint64_t bytes = 0;
+			
+		private:
+			context &ctx;
+			phase ph;
+		};
+		
+		void begin_phase(phase ph) {
+			phase_start = std::chrono::steady_clock::now();
+			cur_phase = ph;
+			phase_deadline = deadlines[ph].count() ? phase_start + deadlines[ph] : std::chrono::steady_clock::time_point::max();
+			phase_start_cpu = thread_cpu_time();
+			phase_child = {};
+			
+			if (instrumentfn) {
+				instrumentfn(ph, PHASE_BEGIN, phase_stats{});
+			}
+		}
+		
+		void end_phase(phase ph, uint64_t bytes) {
+			auto &ps = job->metrics.phases[ph];
+			ps.ran = true;
+			ps.wall = std::chrono::steady_clock::now() - phase_start;
+			ps.cpu = thread_cpu_time() - phase_start_cpu;
+			ps.bytes = bytes;
+			ps.child = phase_child;
+			phase_deadline = std::chrono::steady_clock::time_point::max();
+			
+			if (instrumentfn) {
+				instrumentfn(ph, PHASE_END, ps);
+			}
+		}
+		
+		// Checked wherever convert can wait for long: during downloads, extraction, the CPU budget and child processes.
+		bool should_stop() const {
+			return job->stop.stop_requested() || std::chrono::steady_clock::now() >= phase_deadline;
+		}
+		
+		result stop_result() const {
+			if (job->stop.stop_requested()) {
+				return {ERR_CANCELLED, "Cancelled"};
+			}
+			
+			return {ERR_TIMEOUT, "Timed out (" + std::string{phase_name(cur_phase)} + " took longer than " + std::to_string(deadlines[cur_phase].count()) + "ms)"};
+		}
+		
+		// Whatever has to come from pixiv: the meta unless it was given, then the zip unless it was given. Tracked posts the manifest says are current stop here.
+		stage fetch(convert_job &j) {
+			auto post_id = j.param_post_id;
+			j.track = index && post_id && !j.have_meta && !j.param_ugoira && !j.param_zip;
+			
+			if (j.track) {
+				j.prev = index->find(*post_id, extension(j.fmt));
 				
-				if (!fs::exists(meta_path)) {
-					return {ERR_META_CANTOPEN, "Ugoira file does not contain an animation.json"};
+				if (j.prev && (j.prev->settings != encoder_settings(j.fmt) || j.prev->file != j.dest.filename() || !fs::exists(j.dest))) {
+					j.prev = {};
 				}
 				
-				if (auto res = set_meta(meta_path); !res) {
-					return res;
+				// Without revalidation, being in the manifest is enough. No requests, no scratch dir.
+				if (j.prev && !revalidate) {
+					j.res = {ERR_OK, {}, true};
+					return STAGE_DONE;
 				}
 			}
 			
-			if (!param_meta) {
-				if (!param_post_id) {
-					return {ERR_USAGE, "Post ID must be given if meta file is not"};
+			if (!j.have_meta) {
+				if (!post_id) {
+					j.res = {ERR_USAGE, "Post ID must be given if meta file is not"};
+					return STAGE_DONE;
 				}
 				
+				phase_scope ps{*this, PHASE_META};
 				progress(0, 0, "Downloading ugoira_meta");
 				
-				auto url = "https://www.pixiv.net/ajax/illust/" + std::to_string(*param_post_id) + "/ugoira_meta?lang=en";
+				auto url = "https://www.pixiv.net/ajax/illust/" + std::to_string(*post_id) + "/ugoira_meta?lang=en";
 				auto resp = pixiv_request(url, true);
+				ps.bytes = resp.body.size();
+				
+				if (should_stop()) {
+					j.res = stop_result();
+					return STAGE_DONE;
+				}
 				
-				if (auto r = set_meta(std::string_view{resp.body}); r.err != ERR_OK) {
+				if (auto r = j.set_meta(std::string_view{resp.body}); r.err != ERR_OK) {
 					if (resp.code != 200) {
-						return {ERR_REQ_FAILED, "Failed to fetch ugoira meta info: " + gen_err_message(resp)};
+						r = {ERR_REQ_FAILED, "Failed to fetch ugoira meta info: " + gen_err_message(resp)};
 					}
 					
-					return r;
+					j.res = std::move(r);
+					return STAGE_DONE;
 				}
 			}
 			
-			if (param_meta->contains("error") && param_meta->at("error").get<bool>()) {
-				return {ERR_REQ_FAILED, "Pixiv: " + param_meta->at("message").get<std::string>()};
+			if (j.res = check_meta(j.param_meta); !j.res) {
+				return STAGE_DONE;
 			}
 			
-			auto mi = get_meta_info(*param_meta);
-			
-			if (!mi) {
-				return {ERR_META_INVALID, "Invalid meta file (missing fields or wrong data types)"};
-			}
+			auto &mi = j.param_meta;
+			j.hash = delay_hash(mi);
 			
-			if (!param_zip) {
+			if (!j.param_zip) {
+				phase_scope ps{*this, PHASE_ZIP};
 				progress(0, 0, "Downloading ugoira.zip");
 				
-				auto resp = pixiv_request(mi->zip_url, true);
+				// If nothing in the meta changed, the zip only needs downloading if its ETag did.
+				std::string_view if_none_match;
+				
+				if (j.prev && j.prev->zip_url == mi.zip_url && j.prev->delay_hash == j.hash) {
+					if_none_match = j.prev->etag;
+				}
+				
+				auto resp = pixiv_request(mi.zip_url, true, if_none_match);
+				ps.bytes = resp.body.size();
+				
+				if (should_stop()) {
+					j.res = stop_result();
+					return STAGE_DONE;
+				}
+				
+				if (resp.code == 304 && !if_none_match.empty()) {
+					j.res = {ERR_OK, {}, true};
+					return STAGE_DONE;
+				}
 				
 				if (resp.code != 200) {
-					return {ERR_REQ_FAILED, "Failed to fetch ugoira frames (zip): " + gen_err_message(resp)};
+					j.res = {ERR_REQ_FAILED, "Failed to fetch ugoira frames (zip): " + gen_err_message(resp)};
+					return STAGE_DONE;
 				}
 				
-				auto zip_path = temp_dir / "ugoira.zip";
-				std::ofstream out{zip_path};
-				out.write(resp.body.data(), resp.body.size());
-				param_zip = zip_path;
+				// Extracted straight from memory, the zip itself never touches the disk.
+				j.etag = std::move(resp.etag);
+				j.zip_body = std::move(resp.body);
+				j.set_zip(std::as_bytes(std::span{j.zip_body}));
+			}
+			
+			return STAGE_EXTRACT;
+		}
+		
+		// Extracts the zip or .ugoira into a scratch directory. The meta of a .ugoira comes from its animation.json.
+		stage extract(convert_job &j) {
+			// Only a .ugoira's meta has to wait for extraction. A bad one given separately is rejected without extracting anything.
+			if (!j.param_ugoira) {
+				if (j.res = check_meta(j.param_meta); !j.res) {
+					return STAGE_DONE;
+				}
 			}
 			
-			if (!unzipped) {
-				if (auto res = unzip(*param_zip, frames_path); !res) {
-					return res;
+			try {
+				auto &src = j.param_ugoira ? *j.param_ugoira : *j.param_zip;
+				phase_scope ps{*this, PHASE_UNZIP};
+				ps.bytes = zip_size(src);
+				
+				// Zips on disk are mapped, so the central directory gives the exact extracted size to lease for (compressed or not), and stored ones are extracted from the mapping.
+				std::optional<file_map> map;
+				const std::span<const std::byte> *data = std::get_if<std::span<const std::byte>>(&src);
+				
+				if (!data) {
+					data = &map.emplace(std::get<fs::path>(src)).data();
+				}
+				
+				auto zv = zip_view::open(*data);
+				
+				if (j.res = lease_work_dir(zv ? zv->extracted_size() : ps.bytes); !j.res) {
+					return STAGE_DONE;
+				}
+				
+				if (j.res = unzip(src, zv ? &*zv : nullptr, frames_path(j)); !j.res) {
+					return STAGE_DONE;
+				}
+			}
+			catch (const fs::filesystem_error &e) {
+				j.res = {ERR_ZIP_CANTOPEN, std::string{"Failed to extract frames: "} + e.what()};
+				return STAGE_DONE;
+			}
+			
+			// A downloaded zip isn't needed once it's extracted, don't keep it in memory while waiting for an encoder.
+			if (!j.zip_body.empty()) {
+				j.param_zip = {};
+				std::string{}.swap(j.zip_body);
+			}
+			
+			if (j.param_ugoira) {
+				auto meta_path = frames_path(j) / "animation.json";
+				
+				if (!fs::exists(meta_path)) {
+					j.res = {ERR_META_CANTOPEN, "Ugoira file does not contain an animation.json"};
+					return STAGE_DONE;
+				}
+				
+				if (j.res = j.set_meta(meta_path); !j.res) {
+					return STAGE_DONE;
+				}
+				
+				if (j.res = check_meta(j.param_meta); !j.res) {
+					return STAGE_DONE;
 				}
 			}
 			
-			return do_convert(*mi, frames_path, dest, fmt);
+			return STAGE_ENCODE;
 		}
 		
-		void set_user_agent(std::string ua) {
-			user_agent = std::move(ua);
+		stage encode(convert_job &j) {
+			{
+				phase_scope ps{*this, PHASE_ENCODE};
+				
+				if (j.res = do_convert(j.param_meta, frames_path(j), j.dest, j.fmt); !j.res) {
+					return STAGE_DONE;
+				}
+			}
+			
+			if (j.track) {
+				manifest_entry e;
+				e.id = *j.param_post_id;
+				e.file = j.dest.filename().string();
+				e.zip_url = j.param_meta.zip_url;
+				e.etag = std::move(j.etag);
+				e.delay_hash = j.hash;
+				e.format = extension(j.fmt);
+				e.settings = encoder_settings(j.fmt);
+				index->record(std::move(e));
+			}
+			
+			return STAGE_DONE;
 		}
 		
-		void set_session_id(std::string sid) {
-			session_id = std::move(sid);
+		static result check_meta(const meta_info &mi) {
+			if (mi.error) {
+				return {ERR_REQ_FAILED, "Pixiv: " + mi.message};
+			}
+			
+			if (!mi.valid) {
+				return {ERR_META_INVALID, "Invalid meta file (missing fields or wrong data types)"};
+			}
+			
+			return {};
 		}
 		
-		auto post_id() const {
-			return param_post_id;
+		static fs::path frames_path(const convert_job &j) {
+			return j.work_dir.path() / "frames";
 		}
 		
-		void show_progress(bool yn) {
-			showprogress = yn;
-		}
+		// A file mapped read-only for as long as the object lives. data() is empty if it couldn't be mapped.
+		struct file_map {
+			explicit file_map(const fs::path &path) {
+				int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+				
+				if (fd < 0) {
+					return;
+				}
+				
+				struct stat st;
+				
+				if (fstat(fd, &st) == 0 && st.st_size > 0) {
+					if (void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0); p != MAP_FAILED) {
+						map = {static_cast<const std::byte*>(p), size_t(st.st_size)};
+					}
+				}
+				
+				close(fd);
+			}
+			
+			file_map(const file_map&) = delete;
+			file_map &operator=(const file_map&) = delete;
+			
+			~file_map() {
+				if (!map.empty()) {
+					munmap(const_cast<std::byte*>(map.data()), map.size());
+				}
+			}
+			
+			const std::span<const std::byte> &data() const {
+				return map;
+			}
+			
+		private:
+			std::span<const std::byte> map;
+		};
 		
-		void set_progressfn(std::function<progress_function> fn) {
-			progressfn = std::move(fn);
+		result lease_work_dir(uint64_t bytes) {
+			if (!scratchpool && !own_scratch) {
+				own_scratch = std::make_unique<scratch_pool>();
+			}
+			
+			job->work_dir = (scratchpool ? scratchpool : own_scratch.get())->acquire(bytes);
+			
+			if (!job->work_dir) {
+				return {ERR_ZIP_CANTOPEN, "Failed to create a scratch directory"};
+			}
+			
+			return {};
 		}
 		
-		bool print_commands = false;
-		
-	private:
-		struct frame {
-			std::string name;
-			int delay = 0;
-		};
-		
-		struct meta_info {
-			std::string zip_url;
-			std::vector<frame> frames;
-		};
+		static uint64_t zip_size(const zip_source &src) {
+			if (auto data = std::get_if<std::span<const std::byte>>(&src)) {
+				return data->size();
+			}
+			
+			std::error_code ec;
+			auto sz = fs::file_size(std::get<fs::path>(src), ec);
+			return ec ? 0 : sz;
+		}
 		
-		result unzip(const fs::path &zip, const fs::path &dest) {
+		// zv is src's parsed directory, if it could be read. Stored zips are extracted straight from it, anything else goes through unzip.
+		result unzip(const zip_source &src, const zip_view *zv, const fs::path &dest) {
+			if (auto data = std::get_if<std::span<const std::byte>>(&src)) {
+				return unzip(*data, zv, dest);
+			}
+			
+			auto &zip = std::get<fs::path>(src);
+			
 			if (!fs::exists(zip)) {
 				return {ERR_ZIP_CANTOPEN, "File doesn't exist: " + zip.native()};
 			}
 			
 			fs::create_directory(dest);
 			
-			if (!run_unzip(zip, dest)) {
-				return {ERR_CMD_FAILED, "unzip command failed"};
+			if (zv && zv->all_stored()) {
+				return extract_stored(*zv, dest);
 			}
 			
-			return {};
+			return run_unzip(zip, dest);
 		}
 		
-		std::optional<meta_info> get_meta_info(const json &meta) {
-			meta_info mi;
+		result unzip(std::span<const std::byte> data, const zip_view *zv, const fs::path &dest) {
+			fs::create_directory(dest);
 			
-			try {
-				// Meta files fetched directly from pixiv are wrapped in more JSON containing the error code,
-				// and the actual meta file is in body. But PixivUtil2 only outputs the value of body without
-				// the wrapping JSON, so support both cases.
-				auto &body = meta.contains("body") ?
-				             meta.at("body") :
-				             meta;
+			if (zv && zv->all_stored()) {
+				return extract_stored(*zv, dest);
+			}
+			
+			// Compressed or otherwise unusual zip, hand it to unzip through a memfd so it still doesn't go through the disk.
+			int fd = memfd_create("ugoira.zip", MFD_CLOEXEC);
+			
+			if (fd < 0) {
+				return {ERR_ZIP_CANTOPEN, "Failed to create memfd for zip"};
+			}
+			
+			scope_guard close_fd = [fd] {
+				close(fd);
+			};
+			
+			for (size_t off = 0; off < data.size();) {
+				auto n = write(fd, data.data() + off, data.size() - off);
 				
-				body.at("originalSrc").get_to(mi.zip_url);
+				if (n < 0) {
+					return {ERR_ZIP_CANTOPEN, "Failed to write zip to memfd"};
+				}
 				
-				auto &frames = body.at("frames");
+				off += n;
+			}
+			
+			return run_unzip("/proc/self/fd/" + std::to_string(fd), dest, {fd});
+		}
+		
+		static bool safe_entry_name(std::string_view name) {
+			if (name.empty() || name.starts_with('/') || name.find('\\') != name.npos) {
+				return false;
+			}
+			
+			for (auto p = name; !p.empty();) {
+				auto comp = p.substr(0, p.find('/'));
 				
-				for (auto &f : frames) {
-					auto &frame = mi.frames.emplace_back();
-					f.at("file").get_to(frame.name);
-					f.at("delay").get_to(frame.delay);
+				if (comp == "..") {
+					return false;
 				}
 				
-				return std::move(mi);
+				p.remove_prefix(std::min(p.size(), comp.size() + 1));
 			}
-			catch (...) {
-				return {};
+			
+			return true;
+		}
+		
+		result extract_stored(const zip_view &zv, const fs::path &dest) {
+			for (const auto &e : zv.entries()) {
+				if (should_stop()) {
+					return stop_result();
+				}
+				
+				if (!safe_entry_name(e.name)) {
+					return {ERR_ZIP_CANTOPEN, "Zip contains unsafe path: " + std::string{e.name}};
+				}
+				
+				auto path = dest / e.name;
+				
+				if (e.is_directory()) {
+					fs::create_directories(path);
+					continue;
+				}
+				
+				if (e.name.find('/') != e.name.npos) {
+					fs::create_directories(path.parent_path());
+				}
+				
+				std::ofstream out{path, std::ios::binary};
+				out.write(reinterpret_cast<const char*>(e.data.data()), e.data.size());
+				
+				if (!out) {
+					return {ERR_ZIP_CANTOPEN, "Failed to write " + path.string()};
+				}
 			}
+			
+			return {};
 		}
 		
 		struct frame_stats {
@@ -353,6 +899,26 @@ namespace ugconv {
 			float const_fps;
 		};
 		
+		// FNV-1a over frame names and delays.
+		static uint64_t delay_hash(const meta_info &mi) {
+			uint64_t h = 0xcbf29ce484222325;
+			
+			auto mix = [&h](std::string_view bytes) {
+				for (unsigned char c : bytes) {
+					h = (h ^ c) * 0x100000001b3;
+				}
+			};
+			
+			for (const auto &f : mi.frames) {
+				mix(mi.name(f));
+				mix(std::string_view{"\0", 1});
+				mix(std::to_string(f.delay));
+				mix(std::string_view{"\0", 1});
+			}
+			
+			return h;
+		}
+		
 		frame_stats get_frame_stats(const meta_info &mi) {
 			frame_stats fs;
 			
@@ -387,7 +953,7 @@ namespace ugconv {
 			out << std::fixed;
 			
 			for (const auto &f : mi.frames) {
-				out << "file '" << (frames_path / f.name).string() << "'\n";
+				out << "file " << concat_quote(frames_path / mi.name(f)) << '\n';
 				
 				if (!fs.is_constant) {
 					out << "duration ";
@@ -404,61 +970,108 @@ namespace ugconv {
 			}
 			
 			if (fmt == FMT_WEBM && fs.avg_fps < 5) {
-				out << "file '" << (frames_path / mi.frames.back().name).string() << "'\n";
+				out << "file " << concat_quote(frames_path / mi.name(mi.frames.back())) << '\n';
 			}
 		}
 		
-		static std::string gen_convert_cmd(const fs::path &concat, const fs::path &dest, format fmt, const frame_stats &fs) {
-			std::stringstream ss;
+		// ffmpeg's concat demuxer unquotes like a shell does, so a ' inside the path has to be closed, escaped and reopened.
+		static std::string concat_quote(const fs::path &path) {
+			std::string out = "'";
 			
-			ss << "ffmpeg -loglevel error -y -f concat -safe 0 ";
+			for (char c : path.string()) {
+				if (c == '\'') {
+					out += "'\\''";
+				}
+				else {
+					out += c;
+				}
+			}
+			
+			out += '\'';
+			return out;
+		}
+		
+		// threads == 0 leaves the thread count up to ffmpeg.
+		static std::vector<std::string> gen_convert_cmd(const fs::path &concat, const fs::path &dest, format fmt, const frame_stats &fs, unsigned threads) {
+			auto num = [](float x) {
+				std::stringstream ss;
+				ss << x;
+				return ss.str();
+			};
+			
+			std::vector<std::string> cmd = {"ffmpeg", "-loglevel", "error", "-y", "-f", "concat", "-safe", "0"};
 			
 			if (fs.is_constant) {
-				ss << "-r " << fs.const_fps << ' ';
+				cmd.insert(cmd.end(), {"-r", num(fs.const_fps)});
 			}
 			
-			ss << "-i '" << concat.string() << "' ";
+			cmd.insert(cmd.end(), {"-i", concat.string()});
 			
 			if (fmt == FMT_GIF) {
-				ss << "-vf 'split[s0][s1];[s0]palettegen[p];[s1][p]paletteuse=dither=sierra2' -f gif ";
+				cmd.insert(cmd.end(), {"-vf", "split[s0][s1];[s0]palettegen[p];[s1][p]paletteuse=dither=sierra2", "-f", "gif"});
 			}
 			else if (fmt == FMT_WEBM) {
-				ss << "-f webm -c:v libvpx -b:v 10M -crf 4 ";
+				cmd.insert(cmd.end(), {"-f", "webm", "-c:v", "libvpx", "-b:v", "10M", "-crf", "4"});
 			}
 			
-			ss << "-fflags bitexact ";
-			ss << "-vsync " << (fs.is_constant ? "cfr" : "vfr") << ' ';
+			cmd.insert(cmd.end(), {"-fflags", "bitexact"});
+			cmd.insert(cmd.end(), {"-vsync", fs.is_constant ? "cfr" : "vfr"});
 			
 			float fps_limit = (fmt == FMT_GIF ? 50.f : 60.f);
 			
 			if (fs.is_constant) {
-				ss << "-r " << std::min(fs.const_fps, fps_limit) << ' ';
+				cmd.insert(cmd.end(), {"-r", num(std::min(fs.const_fps, fps_limit))});
 			}
 			
 			if (fmt == FMT_WEBM && !fs.is_constant) {
-				ss << "-enc_time_base 1/1000 -vf 'settb=1/1000,setpts=PTS*0.001' ";
+				cmd.insert(cmd.end(), {"-enc_time_base", "1/1000", "-vf", "settb=1/1000,setpts=PTS*0.001"});
 			}
 			
-			ss << '\'' << dest.string() << '\'';
+			if (threads) {
+				cmd.insert(cmd.end(), {"-threads", std::to_string(threads)});
+			}
 			
-			return ss.str();
+			cmd.push_back(dest.string());
+			
+			return cmd;
 		}
 		
 		result do_convert(const meta_info &mi, const fs::path &frames_path, const fs::path &dest, format fmt) {
-			assert(!temp_dir.empty());
+			assert(job->work_dir);
 			
 			auto fs = get_frame_stats(mi);
 			
-			auto concat_path = temp_dir / "ffmpeg_input.txt";
+			auto concat_path = job->work_dir.path() / "ffmpeg_input.txt";
 			create_concat_file(frames_path, mi, fs, fmt, concat_path);
 			
+			cpu_lease lease;
+			process_opts opts;
+			
+			if (cpubudget) {
+				auto l = cpubudget->acquire([this] { return should_stop(); });
+				
+				if (!l) {
+					return stop_result();
+				}
+				
+				lease = std::move(*l);
+				
+				if (cpubudget->pin) {
+					opts.cpus = lease.cpus();
+				}
+				
+				opts.nice = cpubudget->nice;
+			}
+			
 			auto dest_part = dest + ".part";
-			auto cmd = gen_convert_cmd(concat_path, dest_part, fmt, fs);
+			auto cmd = gen_convert_cmd(concat_path, dest_part, fmt, fs, lease.threads());
 			
 			progress("Encoding to " + extension(fmt));
 			
-			if (!runshell(std::move(cmd))) {
-				return {ERR_CMD_FAILED, "ffmpeg command failed"};
+			if (auto res = run_command(cmd, opts); !res) {
+				std::error_code ec;
+				fs::remove(dest_part, ec);
+				return res;
 			}
 			
 			fs::rename(dest_part, dest);
@@ -466,51 +1079,66 @@ namespace ugconv {
 			return {};
 		}
 		
-		bool runshell(std::string cmd) {
+		result run_command(const std::vector<std::string> &argv, process_opts opts = {}) {
 			if (print_commands) {
-				std::cout << cmd << '\n';
+				std::cout << shell_quote(argv) << '\n';
 			}
 			
-			return system(cmd.c_str()) == 0;
-		}
-		
-		bool run_unzip(fs::path zip, fs::path dest) {
-			std::stringstream ss;
-			ss << "unzip -q " << '\'' << zip.string() << '\'' << " -d " << '\'' << dest.string() << '\'';
-			return runshell(ss.str());
-		}
-		
-		std::string gen_random_string(size_t len, auto &rng) {
-			std::string out;
-			out.resize(len);
+			opts.cancelfn = [this] {
+				return should_stop();
+			};
 			
-			std::string_view chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ1234567890";
-			std::uniform_int_distribution distr{size_t(0), chars.size() - 1};
+			auto pr = run_process(argv, opts);
+			phase_child.add(pr.usage);
 			
-			for (auto &c : out) {
-				c = chars[distr(rng)];
+			if (pr.ok()) {
+				return {};
 			}
 			
-			return out;
-		}
-		
-		void setup_temp_dir() {
-			std::mt19937 rng{std::random_device{}()};
+			// A child that failed because of e.g. the same Ctrl-C that cancelled us wasn't killed by run_process, but it's still a cancellation.
+			if (pr.cancelled || should_stop()) {
+				return stop_result();
+			}
 			
-			do {
-				auto str = gen_random_string(32, rng);
-				auto base = fs::temp_directory_path() / "ugoira-convert";
-				fs::create_directories(base);
-				temp_dir = base / str;
-			} while (!fs::create_directory(temp_dir));
-		}
-		
-		void teardown_temp_dir() {
-			if (temp_dir.empty()) {
-				return;
+			if (!pr.started) {
+				return {ERR_CMD_FAILED, "Failed to run " + pr.err};
+			}
+			
+			auto msg = argv[0] + " command failed";
+			
+			if (pr.timed_out) {
+				msg += " (timed out)";
+			}
+			else if (pr.signal) {
+				msg += " (killed by signal " + std::to_string(pr.signal) + ")";
+			}
+			else {
+				msg += " (exit code " + std::to_string(pr.exit_code) + ")";
+			}
+			
+			// stderr usually ends with the actual error, so keep only the tail of it.
+			auto err = std::string_view{pr.err};
+			
+			while (!err.empty() && isspace(static_cast<unsigned char>(err.back()))) {
+				err.remove_suffix(1);
+			}
+			
+			if (err.size() > 1000) {
+				err = err.substr(err.size() - 1000);
 			}
 			
-			fs::remove_all(temp_dir);
+			if (!err.empty()) {
+				msg += ":\n";
+				msg += err;
+			}
+			
+			return {ERR_CMD_FAILED, std::move(msg)};
+		}
+		
+		result run_unzip(const fs::path &zip, const fs::path &dest, std::vector<int> inherit_fds = {}) {
+			process_opts opts;
+			opts.inherit_fds = std::move(inherit_fds);
+			return run_command({"unzip", "-q", zip.string(), "-d", dest.string()}, opts);
 		}
 		
 		std::string gen_cookies() {
@@ -523,13 +1151,26 @@ namespace ugconv {
 			return ss.str();
 		}
 		
-		response pixiv_request(std::string_view url, bool prog = false) {
+		response pixiv_request(std::string_view url, bool prog = false, std::string_view if_none_match = {}) {
 			auto cookies = gen_cookies();
 			
 			request_opts opts;
 			opts.referer = "https://www.pixiv.net/";
 			opts.user_agent = user_agent;
 			opts.cookies = cookies;
+			opts.if_none_match = if_none_match;
+			opts.low_speed_limit = low_speed_limit;
+			opts.low_speed_time = low_speed_time;
+			opts.abortfn = [this] {
+				return should_stop();
+			};
+			
+			// abortfn is only polled about once a second on a stalled connection, so let curl enforce the deadline too.
+			// With some slack, so that when it fires should_stop agrees and the result is ERR_TIMEOUT rather than a failed request.
+			if (phase_deadline != std::chrono::steady_clock::time_point::max()) {
+				auto left = std::chrono::ceil<std::chrono::milliseconds>(phase_deadline - std::chrono::steady_clock::now());
+				opts.timeout = std::max(left, std::chrono::milliseconds{0}) + std::chrono::milliseconds{50};
+			}
 			
 			if (prog) {
 				opts.progressfn = [this](off_t total, off_t now) {
@@ -558,29 +1199,47 @@ namespace ugconv {
 		}
 		
 		void progress(std::string msg) {
-			if (showprogress && progressfn) {
-				progressfn(PROG_MESSAGE, std::move(msg), 0, 0);
+			if (job->progressfn) {
+				job->progressfn(PROG_MESSAGE, std::move(msg), 0, 0);
 			}
 		}
 		
 		void progress(off_t total, off_t now, std::string msg = {}) {
-			if (showprogress && progressfn) {
-				progressfn(PROG_BAR, std::move(msg), total, now);
+			if (job->progressfn) {
+				job->progressfn(PROG_BAR, std::move(msg), total, now);
 			}
 		}
 		
 		bool showprogress = true;
 		std::function<progress_function> progressfn;
+		std::function<instrument_function> instrumentfn;
+		
+		job_metrics last_metrics;
+		std::chrono::steady_clock::time_point phase_start;
+		duration phase_start_cpu{};
+		child_usage phase_child;
+		phase cur_phase = PHASE_META;
+		
+		std::stop_token stoken;
+		std::array<std::chrono::milliseconds, PHASE_COUNT> deadlines{};
+		std::chrono::steady_clock::time_point phase_deadline = std::chrono::steady_clock::time_point::max();
+		long low_speed_limit = 0;
+		std::chrono::seconds low_speed_time{0};
 		
-		std::string user_agent = "Mozilla/5.0 (X11; Linux x86_64; rv:91.0) Gecko/20100101 Firefox/91.0";
+		std::string user_agent{default_user_agent};
 		std::string session_id;
 		
-		std::optional<uint64_t> param_post_id;
-		std::optional<fs::path> param_ugoira;
-		std::optional<json> param_meta;
-		std::optional<fs::path> param_zip;
+		scratch_pool *scratchpool = nullptr;
+		std::unique_ptr<scratch_pool> own_scratch;
+		
+		// What convert works on, reused from one call to the next so its buffers are. After own_scratch, its lease has to go first.
+		convert_job pending;
+		// The job run_stage is working on.
+		convert_job *job = nullptr;
 		
-		fs::path temp_dir;
+		cpu_budget *cpubudget = nullptr;
+		manifest *index = nullptr;
+		bool revalidate = false;
 		
 		std::unique_ptr<requester> default_requester;
 		requester *req = nullptr;
@@ -0,0 +1,155 @@
+#pragma once
+
+#include <span>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <cstddef>
+#include <string.h>
+#include <stdint.h>
+
+namespace ugconv {
+	struct zip_entry {
+		std::string_view name;
+		uint16_t method = 0;
+		uint16_t flags = 0;
+		// Uncompressed size.
+		uint64_t size = 0;
+		// Points directly into the archive buffer. Only meaningful as file contents if stored() is true.
+		std::span<const std::byte> data;
+		
+		bool is_directory() const {
+			return name.ends_with('/');
+		}
+		
+		bool stored() const {
+			return method == 0 && !(flags & 1);
+		}
+	};
+	
+	// Minimal read-only view over a zip archive held in memory.
+	// Only the central directory is parsed, and entry data is referenced in place, so nothing is copied.
+	// Ugoira zips from pixiv (and PixivUtil2) are STORED, so this is enough to get at the frames without an unzip process.
+	// Deflated or encrypted entries are still listed, but callers must fall back to a real unzip for those.
+	// ZIP64 and multi-disk archives are rejected.
+	struct zip_view {
+		static std::optional<zip_view> open(std::span<const std::byte> buf) {
+			static constexpr size_t eocd_size = 22;
+			static constexpr size_t cdh_size = 46;
+			static constexpr size_t lfh_size = 30;
+			
+			if (buf.size() < eocd_size) {
+				return {};
+			}
+			
+			// The end of central directory record is followed by a comment of up to 65535 bytes, so scan backwards for it.
+			size_t eocd = buf.size() - eocd_size;
+			size_t scan_end = buf.size() > eocd_size + 0xffff ? buf.size() - eocd_size - 0xffff : 0;
+			
+			while (read32(buf, eocd) != 0x06054b50) {
+				if (eocd == scan_end) {
+					return {};
+				}
+				
+				eocd--;
+			}
+			
+			if (read16(buf, eocd + 4) != 0 || read16(buf, eocd + 6) != 0) {
+				return {};
+			}
+			
+			size_t count = read16(buf, eocd + 10);
+			size_t cd_size = read32(buf, eocd + 12);
+			size_t cd_offset = read32(buf, eocd + 16);
+			
+			if (cd_offset > eocd || cd_size > eocd - cd_offset) {
+				return {};
+			}
+			
+			zip_view zv;
+			zv.files.reserve(count);
+			
+			size_t p = cd_offset;
+			
+			for (size_t i = 0; i < count; i++) {
+				if (p + cdh_size > eocd || read32(buf, p) != 0x02014b50) {
+					return {};
+				}
+				
+				zip_entry e;
+				e.flags = read16(buf, p + 8);
+				e.method = read16(buf, p + 10);
+				
+				size_t comp_size = read32(buf, p + 20);
+				e.size = read32(buf, p + 24);
+				size_t name_len = read16(buf, p + 28);
+				size_t extra_len = read16(buf, p + 30);
+				size_t comment_len = read16(buf, p + 32);
+				size_t local_offset = read32(buf, p + 42);
+				
+				if (p + cdh_size + name_len > eocd) {
+					return {};
+				}
+				
+				e.name = {reinterpret_cast<const char*>(buf.data() + p + cdh_size), name_len};
+				
+				// The local header can have a different extra field length than the central one, so it has to be read too.
+				if (local_offset + lfh_size > cd_offset || read32(buf, local_offset) != 0x04034b50) {
+					return {};
+				}
+				
+				size_t data_offset = local_offset + lfh_size + read16(buf, local_offset + 26) + read16(buf, local_offset + 28);
+				
+				if (data_offset > cd_offset || comp_size > cd_offset - data_offset) {
+					return {};
+				}
+				
+				e.data = buf.subspan(data_offset, comp_size);
+				zv.files.push_back(e);
+				
+				p += cdh_size + name_len + extra_len + comment_len;
+			}
+			
+			return zv;
+		}
+		
+		const std::vector<zip_entry> &entries() const {
+			return files;
+		}
+		
+		// Space the archive takes up once extracted.
+		uint64_t extracted_size() const {
+			uint64_t total = 0;
+			
+			for (const auto &e : files) {
+				total += e.size;
+			}
+			
+			return total;
+		}
+		
+		// True if every file in the archive can be read straight out of the buffer.
+		bool all_stored() const {
+			for (const auto &e : files) {
+				if (!e.is_directory() && !e.stored()) {
+					return false;
+				}
+			}
+			
+			return true;
+		}
+		
+	private:
+		static uint16_t read16(std::span<const std::byte> buf, size_t off) {
+			auto p = reinterpret_cast<const uint8_t*>(buf.data() + off);
+			return uint16_t(p[0] | (p[1] << 8));
+		}
+		
+		static uint32_t read32(std::span<const std::byte> buf, size_t off) {
+			auto p = reinterpret_cast<const uint8_t*>(buf.data() + off);
+			return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+		}
+		
+		std::vector<zip_entry> files;
+	};
+}
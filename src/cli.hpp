@@ -0,0 +1,159 @@
+#pragma once
+
+#include <ugconv/ugconv.hpp>
+
+#include <string>
+#include <optional>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <stop_token>
+#include <signal.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+// If out is empty or a directory, name the output after the post ID (or "out" if there is none).
+inline fs::path output_path(fs::path out, ugconv::format fmt, std::optional<uint64_t> post_id) {
+	if (!out.empty() && !fs::is_directory(out)) {
+		return out;
+	}
+	
+	auto ext = ugconv::extension(fmt);
+	fs::path name;
+	
+	if (post_id) {
+		name = std::to_string(*post_id) + '.' + std::string{ext};
+	}
+	else {
+		name = "out." + std::string{ext};
+	}
+	
+	if (out.empty()) {
+		return name;
+	}
+	
+	return out / name;
+}
+
+// One JSON object per line, appended. Shared between threads.
+struct metrics_log {
+	bool open(const fs::path &path) {
+		out.open(path, std::ios::app);
+		return bool(out);
+	}
+	
+	explicit operator bool () const {
+		return out.is_open();
+	}
+	
+	void write(const nlohmann::json &record) {
+		std::lock_guard lk{mtx};
+		out << record.dump() << '\n' << std::flush;
+	}
+	
+private:
+	std::mutex mtx;
+	std::ofstream out;
+};
+
+inline nlohmann::json metrics_record(const ugconv::job_metrics &m, const ugconv::result &res, std::optional<uint64_t> post_id, const fs::path &dest, ugconv::format fmt) {
+	auto rec = to_json(m);
+	rec["dest"] = dest.string();
+	rec["format"] = ugconv::extension(fmt);
+	rec["ok"] = bool(res);
+	rec["up_to_date"] = res.up_to_date;
+	
+	if (post_id) {
+		rec["post_id"] = *post_id;
+	}
+	
+	if (!res) {
+		rec["error"] = int(res.err);
+		rec["message"] = res.message;
+	}
+	
+	return rec;
+}
+
+// -timeout limits every phase of a conversion, and -stall aborts downloads that fall below 1 KiB/s for that long.
+inline void set_limits(ugconv::context &ctx, std::chrono::seconds timeout, std::chrono::seconds stall) {
+	for (int i = 0; i < ugconv::PHASE_COUNT; i++) {
+		ctx.set_deadline(ugconv::phase(i), timeout);
+	}
+	
+	ctx.set_low_speed_limit(stall.count() ? 1024 : 0, stall);
+}
+
+// Requests a stop on the first SIGINT or SIGTERM, a second one kills the process as usual.
+// Call before starting any threads, they must inherit the blocked signals.
+inline void stop_on_signal(std::stop_source stop) {
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, nullptr);
+	
+	std::thread{[sigs, stop]() mutable {
+		int sig;
+		sigwait(&sigs, &sig);
+		stop.request_stop();
+		pthread_sigmask(SIG_UNBLOCK, &sigs, nullptr);
+		
+		for (;;) {
+			pause();
+		}
+	}}.detach();
+}
+
+// With no root, the pool lives in the system temp directory.
+inline std::unique_ptr<ugconv::scratch_pool> make_scratch_pool(const fs::path &root, uint64_t cap) {
+	if (root.empty()) {
+		return std::make_unique<ugconv::scratch_pool>();
+	}
+	
+	return std::make_unique<ugconv::scratch_pool>(root, cap);
+}
+
+struct daemon_opts {
+	fs::path socket_path;
+	unsigned workers = 1;
+	std::string user_agent;
+	std::string session_id;
+	bool print_commands = false;
+	fs::path metrics_path;
+	// Size of the CPU budget encodes are run under, 0 for all CPUs.
+	unsigned cpus = 0;
+	bool pin = false;
+	int nice = 0;
+	// See set_limits, zero for no limit.
+	std::chrono::seconds timeout{0};
+	std::chrono::seconds stall{0};
+	// Where frames are extracted, see make_scratch_pool.
+	fs::path scratch;
+	uint64_t scratch_cap = 0;
+};
+
+int run_daemon(const daemon_opts &opts);
+
+struct import_opts {
+	fs::path src;
+	fs::path out;
+	ugconv::format fmt = ugconv::FMT_WEBM;
+	unsigned workers = 1;
+	bool print_commands = false;
+	bool quiet = false;
+	// Skip works whose output already exists and is newer than the source.
+	bool incremental = false;
+	fs::path metrics_path;
+	unsigned cpus = 0;
+	bool pin = false;
+	int nice = 0;
+	std::chrono::seconds timeout{0};
+	fs::path scratch;
+	uint64_t scratch_cap = 0;
+};
+
+int run_import(const import_opts &opts);
@@ -0,0 +1,591 @@
+#include "cli.hpp"
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <stop_token>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <curl/curl.h>
+
+using nlohmann::json;
+
+namespace {
+	// One client socket. Workers and the reader thread all write to it, so each message is sent under a lock as a single line.
+	struct connection {
+		connection(int fd) noexcept : fd(fd) {}
+		
+		connection(const connection&) = delete;
+		connection &operator=(const connection&) = delete;
+		
+		void send(const json &msg) {
+			auto line = msg.dump();
+			line += '\n';
+			
+			std::lock_guard lk{mtx};
+			
+			for (size_t off = 0; off < line.size();) {
+				auto n = ::send(fd, line.data() + off, line.size() - off, MSG_NOSIGNAL);
+				
+				// If the client went away, the job still runs to completion, there's just nobody to tell.
+				if (n <= 0) {
+					return;
+				}
+				
+				off += n;
+			}
+		}
+		
+		// Jobs from this connection that haven't finished, so the client can cancel them by tag.
+		void track(const json &tag, std::stop_source stop) {
+			std::lock_guard lk{jobs_mtx};
+			jobs.emplace(tag.dump(), std::move(stop));
+		}
+		
+		void untrack(const json &tag, const std::stop_source &stop) {
+			std::lock_guard lk{jobs_mtx};
+			auto [begin, end] = jobs.equal_range(tag.dump());
+			
+			for (auto iter = begin; iter != end; iter++) {
+				if (iter->second == stop) {
+					jobs.erase(iter);
+					return;
+				}
+			}
+		}
+		
+		// Cancels every unfinished job with this tag. False if there were none.
+		bool cancel(const json &tag) {
+			std::lock_guard lk{jobs_mtx};
+			auto [begin, end] = jobs.equal_range(tag.dump());
+			
+			for (auto iter = begin; iter != end; iter++) {
+				iter->second.request_stop();
+			}
+			
+			return begin != end;
+		}
+		
+		~connection() {
+			close(fd);
+		}
+		
+		const int fd;
+		
+	private:
+		std::mutex mtx;
+		std::mutex jobs_mtx;
+		std::multimap<std::string, std::stop_source> jobs;
+	};
+	
+	struct job {
+		std::shared_ptr<connection> conn;
+		json tag;
+		json desc;
+		std::stop_source stop;
+	};
+	
+	struct job_queue {
+		// Fails if the queue has already been closed.
+		bool push(job j) {
+			{
+				std::lock_guard lk{mtx};
+				
+				if (closed) {
+					return false;
+				}
+				
+				jobs.push_back(std::move(j));
+			}
+			
+			cv.notify_one();
+			return true;
+		}
+		
+		// Returns nothing once the queue has been closed.
+		std::optional<job> pop() {
+			std::unique_lock lk{mtx};
+			cv.wait(lk, [this] { return closed || !jobs.empty(); });
+			
+			if (closed) {
+				return {};
+			}
+			
+			auto j = std::move(jobs.front());
+			jobs.pop_front();
+			return j;
+		}
+		
+		// Returns the jobs that never got started.
+		std::deque<job> close() {
+			std::deque<job> left;
+			
+			{
+				std::lock_guard lk{mtx};
+				closed = true;
+				left.swap(jobs);
+			}
+			
+			cv.notify_all();
+			return left;
+		}
+		
+	private:
+		std::mutex mtx;
+		std::condition_variable cv;
+		std::deque<job> jobs;
+		bool closed = false;
+	};
+	
+	json event(const json &tag, std::string_view name) {
+		return {{"job", tag}, {"event", name}};
+	}
+	
+	json done_event(const json &tag, const ugconv::result &res) {
+		auto ev = event(tag, "done");
+		ev["ok"] = bool(res);
+		
+		if (!res) {
+			ev["error"] = int(res.err);
+			ev["message"] = res.message;
+		}
+		
+		return ev;
+	}
+	
+	// Feeds a job description into the context. On failure the context may be left with some parameters set, so the caller must clear them.
+	ugconv::result setup_job(ugconv::context &ctx, const json &desc, const daemon_opts &opts, fs::path &out, ugconv::format &fmt, bool &revalidate, bool &incremental) {
+		try {
+			revalidate = desc.value("revalidate", false);
+			incremental = revalidate || desc.value("incremental", false);
+			
+			ctx.set_user_agent(desc.value("user_agent", opts.user_agent));
+			ctx.set_session_id(desc.value("session_id", opts.session_id));
+			
+			if (desc.contains("ugoira")) {
+				ctx.set_ugoira(fs::path{desc.at("ugoira").get<std::string>()});
+			}
+			else if (desc.contains("meta")) {
+				if (auto res = ctx.set_meta(fs::path{desc.at("meta").get<std::string>()}); !res) {
+					return res;
+				}
+				
+				if (desc.contains("zip")) {
+					ctx.set_zip(fs::path{desc.at("zip").get<std::string>()});
+				}
+			}
+			else if (desc.contains("id")) {
+				ctx.set_post(desc.at("id").get<uint64_t>());
+			}
+			else if (desc.contains("url")) {
+				if (auto res = ctx.set_post(desc.at("url").get<std::string>()); !res) {
+					return res;
+				}
+			}
+			else {
+				return {ugconv::ERR_USAGE, "Job needs one of id, url, ugoira or meta"};
+			}
+			
+			fs::path dest = desc.value("dest", std::string{});
+			std::optional<ugconv::format> f = ugconv::FMT_WEBM;
+			
+			if (desc.contains("fmt")) {
+				f = ugconv::parse_format(desc.at("fmt").get<std::string>());
+				
+				if (!f) {
+					return {ugconv::ERR_USAGE, "Unrecognized format " + desc.at("fmt").get<std::string>()};
+				}
+			}
+			else if (dest.has_extension() && !fs::is_directory(dest)) {
+				f = ugconv::parse_format(dest.extension().string().substr(1));
+				
+				if (!f) {
+					return {ugconv::ERR_USAGE, "Unrecognized extension " + dest.extension().string()};
+				}
+			}
+			
+			fmt = *f;
+			out = output_path(std::move(dest), fmt, ctx.post_id());
+		}
+		catch (std::exception &e) {
+			return {ugconv::ERR_USAGE, "Invalid job: " + std::string{e.what()}};
+		}
+		
+		return {};
+	}
+	
+	struct shared_state {
+		shared_state(const daemon_opts &opts) : budget(opts.cpus), scratch(make_scratch_pool(opts.scratch, opts.scratch_cap)) {
+			budget.pin = opts.pin;
+			budget.nice = opts.nice;
+		}
+		
+		// Manifests are opened the first time a job writes into their directory, and shared by all jobs after that.
+		ugconv::manifest *manifest_for(const fs::path &dest) {
+			auto dir = fs::absolute(dest).parent_path();
+			
+			std::lock_guard lk{manifests_mtx};
+			auto &m = manifests[dir];
+			
+			if (!m) {
+				m = std::make_unique<ugconv::manifest>();
+				
+				if (!m->open(dir / ugconv::manifest::default_name)) {
+					manifests.erase(dir);
+					return nullptr;
+				}
+			}
+			
+			return m.get();
+		}
+		
+		job_queue queue;
+		ugconv::cpu_budget budget;
+		std::unique_ptr<ugconv::scratch_pool> scratch;
+		ugconv::metrics_aggregate totals;
+		metrics_log mlog;
+		
+	private:
+		std::mutex manifests_mtx;
+		std::map<fs::path, std::unique_ptr<ugconv::manifest>> manifests;
+	};
+	
+	void run_job(ugconv::context &ctx, job &j, const daemon_opts &opts, shared_state &st) {
+		auto &conn = *j.conn;
+		fs::path out;
+		ugconv::format fmt = ugconv::FMT_WEBM;
+		bool revalidate = false;
+		bool incremental = false;
+		
+		if (auto res = setup_job(ctx, j.desc, opts, out, fmt, revalidate, incremental); !res) {
+			ctx.clear_params();
+			conn.send(done_event(j.tag, res));
+			return;
+		}
+		
+		int last_percent = -1;
+		
+		ctx.set_progressfn([&](auto type, auto msg, auto total, auto now) {
+			auto ev = event(j.tag, "progress");
+			
+			if (type == ugconv::PROG_MESSAGE) {
+				// End of a progress bar, not interesting to clients.
+				if (msg.empty()) {
+					return;
+				}
+			}
+			else if (type == ugconv::PROG_BAR) {
+				// Progress bars fire on every curl callback, only pass on whole percent changes.
+				int percent = total ? ((float(now) / total) * 100) : 0;
+				
+				if (msg.empty() && percent == last_percent) {
+					return;
+				}
+				
+				last_percent = percent;
+				ev["total"] = total;
+				ev["now"] = now;
+			}
+			
+			if (!msg.empty()) {
+				ev["message"] = std::move(msg);
+			}
+			
+			conn.send(ev);
+		});
+		
+		if (incremental) {
+			auto m = st.manifest_for(out);
+			
+			if (!m) {
+				ctx.clear_params();
+				conn.send(done_event(j.tag, {ugconv::ERR_USAGE, "Failed to open manifest in " + out.parent_path().string()}));
+				return;
+			}
+			
+			ctx.set_manifest(m, revalidate);
+		}
+		
+		ctx.set_stop_token(j.stop.get_token());
+		
+		ugconv::scope_guard reset = [&ctx] {
+			ctx.set_manifest(nullptr);
+			ctx.set_stop_token({});
+		};
+		
+		conn.send(event(j.tag, "started"));
+		
+		auto post_id = ctx.post_id();
+		auto res = ctx.convert(out, fmt);
+		auto ev = done_event(j.tag, res);
+		
+		if (res) {
+			ev["dest"] = fs::absolute(out).string();
+			ev["up_to_date"] = res.up_to_date;
+		}
+		
+		ev["metrics"] = to_json(ctx.metrics());
+		
+		if (res.up_to_date) {
+			st.totals.add_skipped();
+		}
+		else {
+			st.totals.add(ctx.metrics(), res);
+		}
+		
+		if (st.mlog) {
+			auto rec = metrics_record(ctx.metrics(), res, post_id, out, fmt);
+			rec["job"] = j.tag;
+			st.mlog.write(rec);
+		}
+		
+		conn.send(ev);
+	}
+	
+	void worker(shared_state &st, const daemon_opts &opts) {
+		// Lives for as long as the daemon does, so the curl handle (and with it DNS cache, connections and TLS sessions) is reused across jobs.
+		ugconv::context ctx;
+		ctx.print_commands = opts.print_commands;
+		ctx.set_cpu_budget(&st.budget);
+		ctx.set_scratch_pool(st.scratch.get());
+		set_limits(ctx, opts.timeout, opts.stall);
+		
+		while (auto j = st.queue.pop()) {
+			run_job(ctx, *j, opts, st);
+			j->conn->untrack(j->tag, j->stop);
+		}
+	}
+	
+	void reader(std::shared_ptr<connection> conn, shared_state &st, std::atomic<uint64_t> &next_tag) {
+		std::string buf;
+		char chunk[4096];
+		
+		for (;;) {
+			auto n = read(conn->fd, chunk, sizeof chunk);
+			
+			if (n <= 0) {
+				return;
+			}
+			
+			buf.append(chunk, n);
+			
+			size_t start = 0;
+			
+			for (size_t nl; (nl = buf.find('\n', start)) != buf.npos; start = nl + 1) {
+				auto line = std::string_view{buf}.substr(start, nl - start);
+				
+				if (line.find_first_not_of(" \t\r") == line.npos) {
+					continue;
+				}
+				
+				json desc;
+				
+				try {
+					desc = json::parse(line);
+				}
+				catch (std::exception &e) {
+					conn->send({{"event", "error"}, {"message", "Failed to parse job: " + std::string{e.what()}}});
+					continue;
+				}
+				
+				if (!desc.is_object()) {
+					conn->send({{"event", "error"}, {"message", "Job must be a JSON object"}});
+					continue;
+				}
+				
+				if (desc.contains("stats") && !desc.at("stats").is_boolean()) {
+					conn->send({{"event", "error"}, {"message", "stats must be a boolean"}});
+					continue;
+				}
+				
+				// Not a job, answered right away.
+				if (desc.value("stats", false)) {
+					conn->send({{"event", "stats"}, {"stats", st.totals.to_json()}});
+					continue;
+				}
+				
+				if (desc.contains("cancel")) {
+					auto ev = event(desc.at("cancel"), "cancel");
+					ev["ok"] = conn->cancel(desc.at("cancel"));
+					conn->send(ev);
+					continue;
+				}
+				
+				json tag = desc.contains("job") ? desc.at("job") : json(next_tag++);
+				std::stop_source stop;
+				conn->track(tag, stop);
+				conn->send(event(tag, "queued"));
+				
+				if (!st.queue.push({conn, tag, std::move(desc), stop})) {
+					conn->untrack(tag, stop);
+					conn->send(done_event(tag, {ugconv::ERR_USAGE, "Daemon is shutting down"}));
+				}
+			}
+			
+			buf.erase(0, start);
+		}
+	}
+	
+	// A client connection and the thread reading jobs from it. done is set once the reader returns, so it can be joined while the daemon keeps running.
+	struct client {
+		std::shared_ptr<connection> conn;
+		std::thread thread;
+		std::atomic<bool> done = false;
+	};
+	
+	int listen_unix(const fs::path &path) {
+		sockaddr_un addr{};
+		addr.sun_family = AF_UNIX;
+		
+		if (path.native().size() >= sizeof addr.sun_path) {
+			std::cout << "Socket path is too long: " << path << '\n';
+			return -1;
+		}
+		
+		path.native().copy(addr.sun_path, sizeof addr.sun_path - 1);
+		
+		// Left behind by a previous run.
+		if (fs::is_socket(path)) {
+			fs::remove(path);
+		}
+		
+		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		
+		if (fd < 0) {
+			std::cout << "Failed to create socket\n";
+			return -1;
+		}
+		
+		if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof addr) != 0 || listen(fd, SOMAXCONN) != 0) {
+			std::cout << "Failed to listen on " << path << '\n';
+			close(fd);
+			return -1;
+		}
+		
+		return fd;
+	}
+}
+
+int run_daemon(const daemon_opts &opts) {
+	// Not thread-safe, and would otherwise be done implicitly by the first curl_easy_init in whichever worker gets there first.
+	curl_global_init(CURL_GLOBAL_DEFAULT);
+	
+	// Termination signals are handled by a dedicated thread, so block them everywhere else before spawning anything.
+	sigset_t sigs;
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, nullptr);
+	
+	shared_state st{opts};
+	
+	if (!opts.metrics_path.empty() && !st.mlog.open(opts.metrics_path)) {
+		std::cout << "Failed to open metrics file " << opts.metrics_path << '\n';
+		return 1;
+	}
+	
+	int listen_fd = listen_unix(opts.socket_path);
+	
+	if (listen_fd < 0) {
+		return 1;
+	}
+	
+	std::atomic<bool> stopping = false;
+	
+	std::thread sig_thread{[&] {
+		int sig;
+		sigwait(&sigs, &sig);
+		stopping = true;
+		// Wakes up the accept below.
+		shutdown(listen_fd, SHUT_RDWR);
+	}};
+	
+	std::vector<std::thread> workers;
+	
+	for (unsigned i = 0; i < opts.workers; i++) {
+		workers.emplace_back(worker, std::ref(st), std::cref(opts));
+	}
+	
+	std::cout << "Listening on " << opts.socket_path.string() << " with " << opts.workers << " workers and " << st.budget.size() << " CPUs\n";
+	
+	std::atomic<uint64_t> next_tag = 0;
+	std::vector<std::unique_ptr<client>> clients;
+	bool accept_failing = false;
+	
+	while (!stopping) {
+		// Before accepting, so the descriptors of clients that left are free again when accept failed for lack of them.
+		std::erase_if(clients, [](auto &c) {
+			if (!c->done) {
+				return false;
+			}
+			
+			c->thread.join();
+			return true;
+		});
+		
+		int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+		
+		if (fd < 0) {
+			// Out of file descriptors or memory, which would just fail again right away. Give clients time to disconnect.
+			if (!stopping && errno != EINTR && errno != ECONNABORTED) {
+				if (!accept_failing) {
+					std::cout << "Failed to accept a connection: " << std::strerror(errno) << '\n';
+					accept_failing = true;
+				}
+				
+				std::this_thread::sleep_for(std::chrono::milliseconds{100});
+			}
+			
+			continue;
+		}
+		
+		accept_failing = false;
+		
+		auto &c = *clients.emplace_back(std::make_unique<client>());
+		c.conn = std::make_shared<connection>(fd);
+		
+		c.thread = std::thread{[&st, &next_tag, &c] {
+			reader(c.conn, st, next_tag);
+			c.done = true;
+		}};
+	}
+	
+	sig_thread.join();
+	close(listen_fd);
+	fs::remove(opts.socket_path);
+	
+	// Readers use st, so they have to be gone before it is. Shutting down only the read side still lets running jobs report to their clients.
+	for (auto &c : clients) {
+		shutdown(c->conn->fd, SHUT_RD);
+	}
+	
+	for (auto &c : clients) {
+		c->thread.join();
+	}
+	
+	// Jobs already running are allowed to finish, queued ones are dropped.
+	for (auto &j : st.queue.close()) {
+		j.conn->send(done_event(j.tag, {ugconv::ERR_USAGE, "Daemon is shutting down"}));
+	}
+	
+	for (auto &w : workers) {
+		w.join();
+	}
+	
+	if (st.mlog) {
+		st.mlog.write({{"aggregate", st.totals.to_json()}});
+	}
+	
+	return 0;
+}
@@ -0,0 +1,273 @@
+#include "cli.hpp"
+
+#include <ugconv/scheduler.hpp>
+
+#include <iostream>
+#include <iomanip>
+#include <vector>
+#include <string>
+#include <map>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <stop_token>
+
+namespace {
+	// Everything import mode converts is local. Anything that still tries to reach pixiv fails instead.
+	struct offline_requester final : ugconv::requester {
+		ugconv::response get(std::string_view, const ugconv::request_opts&) override {
+			return {0, "Network requests are disabled in import mode"};
+		}
+	};
+	
+	// Either a .ugoira file, or a meta file and zip.
+	struct work {
+		fs::path ugoira;
+		fs::path meta;
+		fs::path zip;
+		// Output path relative to the output directory, without the extension.
+		fs::path rel;
+		uintmax_t size = 0;
+		fs::file_time_type mtime;
+	};
+	
+	// The meta file that goes with a zip, by the names PixivUtil2 and others use:
+	// <stem>.json, <stem>_meta.json, <id>_meta.json for <id>_ugoira<W>x<H>.zip, or ugoira_meta.json if it's the only zip in its directory.
+	std::optional<fs::path> find_meta(const fs::path &zip, bool only_zip) {
+		auto dir = zip.parent_path();
+		auto stem = zip.stem().string();
+		std::vector<fs::path> candidates = {dir / (stem + ".json"), dir / (stem + "_meta.json")};
+		
+		auto id_len = stem.find_first_not_of("0123456789");
+		
+		if (id_len != 0 && id_len != stem.npos) {
+			candidates.push_back(dir / (stem.substr(0, id_len) + "_meta.json"));
+		}
+		
+		if (only_zip) {
+			candidates.push_back(dir / "ugoira_meta.json");
+		}
+		
+		for (auto &c : candidates) {
+			std::error_code ec;
+			
+			if (fs::is_regular_file(c, ec)) {
+				return c;
+			}
+		}
+		
+		return {};
+	}
+	
+	// Largest first, so the longest encodes start early instead of being the tail of the run.
+	std::vector<work> find_works(const fs::path &src, size_t &unmatched) {
+		std::vector<work> works;
+		std::map<fs::path, std::vector<fs::path>> zips;
+		std::error_code ec;
+		
+		for (fs::recursive_directory_iterator iter{src, fs::directory_options::skip_permission_denied, ec}, end; iter != end; iter.increment(ec)) {
+			if (ec || !iter->is_regular_file(ec)) {
+				continue;
+			}
+			
+			auto &path = iter->path();
+			auto ext = path.extension();
+			
+			if (ext == ".ugoira") {
+				auto &w = works.emplace_back();
+				w.ugoira = path;
+			}
+			else if (ext == ".zip") {
+				zips[path.parent_path()].push_back(path);
+			}
+		}
+		
+		for (auto &[dir, list] : zips) {
+			for (auto &zip : list) {
+				auto ugoira = zip;
+				ugoira.replace_extension(".ugoira");
+				
+				// The same work in both forms, the .ugoira already covers it.
+				if (fs::exists(ugoira, ec)) {
+					continue;
+				}
+				
+				auto meta = find_meta(zip, list.size() == 1);
+				
+				if (!meta) {
+					unmatched++;
+					continue;
+				}
+				
+				auto &w = works.emplace_back();
+				w.zip = zip;
+				w.meta = std::move(*meta);
+			}
+		}
+		
+		for (auto &w : works) {
+			auto &file = w.ugoira.empty() ? w.zip : w.ugoira;
+			w.rel = fs::relative(file.parent_path(), src, ec) / file.stem();
+			w.size = fs::file_size(file, ec);
+			w.mtime = fs::last_write_time(file, ec);
+			
+			if (!w.meta.empty()) {
+				w.mtime = std::max(w.mtime, fs::last_write_time(w.meta, ec));
+			}
+		}
+		
+		std::stable_sort(works.begin(), works.end(), [](const work &a, const work &b) {
+			return a.size > b.size;
+		});
+		
+		return works;
+	}
+	
+	bool up_to_date(const fs::path &dest, fs::file_time_type src_mtime) {
+		std::error_code ec;
+		auto mtime = fs::last_write_time(dest, ec);
+		return !ec && mtime >= src_mtime;
+	}
+}
+
+int run_import(const import_opts &opts) {
+	// Ctrl-C lets running conversions clean up and stops the rest from starting.
+	std::stop_source stop;
+	stop_on_signal(stop);
+	
+	size_t unmatched = 0;
+	auto works = find_works(opts.src, unmatched);
+	
+	if (!opts.quiet) {
+		uintmax_t total = 0;
+		
+		for (auto &w : works) {
+			total += w.size;
+		}
+		
+		std::cout << "Found " << works.size() << " works (" << total / (1024 * 1024) << " MiB) in " << opts.src.string() << '\n';
+		
+		if (unmatched) {
+			std::cout << "Skipping " << unmatched << " zips without a meta file\n";
+		}
+	}
+	
+	metrics_log mlog;
+	
+	if (!opts.metrics_path.empty() && !mlog.open(opts.metrics_path)) {
+		std::cout << "Failed to open metrics file " << opts.metrics_path << '\n';
+		return 1;
+	}
+	
+	ugconv::cpu_budget budget{opts.cpus};
+	budget.pin = opts.pin;
+	budget.nice = opts.nice;
+	
+	auto scratch = make_scratch_pool(opts.scratch, opts.scratch_cap);
+	ugconv::metrics_aggregate totals;
+	std::atomic<size_t> failed = 0;
+	std::atomic<size_t> finished = 0;
+	std::mutex print_mtx;
+	auto ext = "." + std::string{ugconv::extension(opts.fmt)};
+	auto start = std::chrono::steady_clock::now();
+	
+	auto report = [&](const work &w, const fs::path &dest, const ugconv::result &res, const ugconv::job_metrics *m) {
+		if (m) {
+			totals.add(*m, res);
+			
+			if (mlog) {
+				auto rec = metrics_record(*m, res, {}, dest, opts.fmt);
+				rec["source"] = (w.ugoira.empty() ? w.zip : w.ugoira).string();
+				mlog.write(rec);
+			}
+		}
+		
+		if (!res) {
+			failed++;
+		}
+		
+		auto n = ++finished;
+		
+		if (!opts.quiet || !res) {
+			std::lock_guard lk{print_mtx};
+			std::cout << '[' << n << '/' << works.size() << "] " << w.rel.string() << ext << ": ";
+			std::cout << (!res ? res.message : res.up_to_date ? "up to date" : "done") << '\n';
+		}
+	};
+	
+	{
+		// Everything is local, so the work is split between extracting and encoding. Encoders get the -j workers, extraction is mostly I/O and needs fewer.
+		// Queues are kept short: every job waiting to be encoded holds its extracted frames in the scratch pool.
+		ugconv::scheduler_opts sopts;
+		sopts.network_workers = 1;
+		sopts.extract_workers = std::max(1u, opts.workers / 2);
+		sopts.encode_workers = opts.workers;
+		sopts.queue_size = opts.workers;
+		
+		sopts.make_requester = [] {
+			return std::make_unique<offline_requester>();
+		};
+		
+		sopts.configure = [&](ugconv::context &ctx) {
+			ctx.show_progress(false);
+			ctx.print_commands = opts.print_commands;
+			ctx.set_cpu_budget(&budget);
+			ctx.set_scratch_pool(scratch.get());
+			set_limits(ctx, opts.timeout, std::chrono::seconds{0});
+		};
+		
+		ugconv::scheduler sched{std::move(sopts)};
+		
+		for (auto &w : works) {
+			if (stop.stop_requested()) {
+				break;
+			}
+			
+			auto dest = opts.out / w.rel;
+			dest += ext;
+			
+			if (opts.incremental && up_to_date(dest, w.mtime)) {
+				totals.add_skipped();
+				report(w, dest, {ugconv::ERR_OK, {}, true}, nullptr);
+				continue;
+			}
+			
+			std::error_code ec;
+			fs::create_directories(dest.parent_path(), ec);
+			
+			ugconv::convert_job j;
+			j.dest = dest;
+			j.fmt = opts.fmt;
+			j.stop = stop.get_token();
+			
+			if (!w.ugoira.empty()) {
+				j.set_ugoira(w.ugoira);
+			}
+			else if (auto res = j.set_meta(w.meta); !res) {
+				report(w, dest, res, &j.metrics);
+				continue;
+			}
+			else {
+				j.set_zip(w.zip);
+			}
+			
+			sched.submit(std::move(j), [&](ugconv::convert_job &j) {
+				report(w, j.dest, j.res, &j.metrics);
+			});
+		}
+		
+		sched.wait();
+	}
+	
+	double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	
+	if (mlog) {
+		mlog.write({{"aggregate", totals.to_json()}});
+	}
+	
+	if (!opts.quiet) {
+		std::cout << "Finished " << finished << " of " << works.size() << " works in " << std::fixed << std::setprecision(1) << secs << "s, " << failed << " failed\n";
+	}
+	
+	return failed || finished < works.size() ? 1 : 0;
+}
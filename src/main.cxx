@@ -1,12 +1,12 @@
-#include <ugconv/ugconv.hpp>
+#include "cli.hpp"
 
 #include <iostream>
+#include <thread>
 #include <vector>
 #include <string>
 #include <string_view>
 #include <unordered_map>
-
-namespace fs = std::filesystem;
+#include <stop_token>
 
 struct option_info {
 	bool has_arg;
@@ -22,6 +22,19 @@ static std::unordered_map<std::string_view, option_info> option_spec = {
 	{"-id", {true}},
 	{"-q", {false}},
 	{"-v", {false}},
+	{"-daemon", {true}},
+	{"-j", {true}},
+	{"-metrics", {true}},
+	{"-cpus", {true}},
+	{"-pin", {false}},
+	{"-nice", {true}},
+	{"-incremental", {false}},
+	{"-revalidate", {false}},
+	{"-timeout", {true}},
+	{"-stall", {true}},
+	{"-import", {true}},
+	{"-scratch", {true}},
+	{"-scratch-cap", {true}},
 };
 
 struct options {
@@ -40,11 +53,6 @@ constexpr auto find(auto &map, U &&key) {
 	return static_cast<decltype(&iter->second)>(nullptr);
 }
 
-static std::string operator+(std::string a, std::string_view b) {
-	a.append(b.data(), b.size());
-	return a;
-}
-
 static options parse_options(int argc, char **argv) {
 	options opts;
 	
@@ -111,7 +119,153 @@ int main(int argc, char **argv) {
 		opts.flags["-s"] = sid;
 	}
 	
+	std::chrono::seconds timeout{0};
+	std::chrono::seconds stall{0};
+	
+	if (auto t = find(opts.flags, "-timeout")) {
+		auto n = ugconv::chars_to_int<unsigned>(*t);
+		
+		if (!n || !*n) {
+			std::cout << "-timeout should be a positive number of seconds\n";
+			return 1;
+		}
+		
+		timeout = std::chrono::seconds{*n};
+	}
+	
+	if (auto s = find(opts.flags, "-stall")) {
+		auto n = ugconv::chars_to_int<unsigned>(*s);
+		
+		if (!n || !*n) {
+			std::cout << "-stall should be a positive number of seconds\n";
+			return 1;
+		}
+		
+		stall = std::chrono::seconds{*n};
+	}
+	
+	fs::path scratch;
+	uint64_t scratch_cap = 0;
+	
+	if (auto s = find(opts.flags, "-scratch")) {
+		scratch = *s;
+	}
+	
+	if (auto c = find(opts.flags, "-scratch-cap")) {
+		auto n = ugconv::chars_to_int<uint64_t>(*c);
+		
+		if (!n || !*n || !find(opts.flags, "-scratch")) {
+			std::cout << "-scratch-cap should be a positive number of MiB, and needs -scratch\n";
+			return 1;
+		}
+		
+		scratch_cap = *n * 1024 * 1024;
+	}
+	
+	// Only used by -daemon and -import.
+	unsigned cpus = 0;
+	int nice = 0;
+	unsigned workers = 0;
+	
+	if (auto c = find(opts.flags, "-cpus")) {
+		auto n = ugconv::chars_to_int<unsigned>(*c);
+		
+		if (!n || !*n) {
+			std::cout << "-cpus should be a positive integer\n";
+			return 1;
+		}
+		
+		cpus = *n;
+	}
+	
+	if (auto nc = find(opts.flags, "-nice")) {
+		auto n = ugconv::chars_to_int<int>(*nc);
+		
+		if (!n) {
+			std::cout << "-nice should be an integer\n";
+			return 1;
+		}
+		
+		nice = *n;
+	}
+	
+	if (auto j = find(opts.flags, "-j")) {
+		auto n = ugconv::chars_to_int<unsigned>(*j);
+		
+		if (!n || !*n) {
+			std::cout << "-j should be a positive integer\n";
+			return 1;
+		}
+		
+		workers = *n;
+	}
+	
+	if (auto src = find(opts.flags, "-import")) {
+		if (opts.args.size() != 1) {
+			std::cout << "-import expects an output directory\n";
+			return 1;
+		}
+		
+		import_opts iopts;
+		iopts.src = *src;
+		iopts.out = opts.args[0];
+		iopts.fmt = determine_format({}, find(opts.flags, "-fmt"));
+		// No downloads to overlap with, so one worker per CPU keeps extraction and encoding going without piling up temp dirs.
+		iopts.workers = workers ? workers : std::max(1u, std::thread::hardware_concurrency());
+		iopts.print_commands = opts.flags.contains("-v");
+		iopts.quiet = opts.flags.contains("-q");
+		iopts.incremental = opts.flags.contains("-incremental");
+		iopts.cpus = cpus;
+		iopts.pin = opts.flags.contains("-pin");
+		iopts.nice = nice;
+		iopts.timeout = timeout;
+		iopts.scratch = scratch;
+		iopts.scratch_cap = scratch_cap;
+		
+		if (auto m = find(opts.flags, "-metrics")) {
+			iopts.metrics_path = *m;
+		}
+		
+		return run_import(iopts);
+	}
+	
+	if (auto sock = find(opts.flags, "-daemon")) {
+		daemon_opts dopts;
+		dopts.socket_path = *sock;
+		// Encodes are limited by the CPU budget anyway, so the extra workers keep downloads going while every CPU is encoding.
+		dopts.workers = workers ? workers : 2 * std::max(1u, std::thread::hardware_concurrency());
+		dopts.print_commands = opts.flags.contains("-v");
+		dopts.cpus = cpus;
+		dopts.pin = opts.flags.contains("-pin");
+		dopts.nice = nice;
+		dopts.timeout = timeout;
+		dopts.stall = stall;
+		dopts.scratch = scratch;
+		dopts.scratch_cap = scratch_cap;
+		
+		if (auto ua = find(opts.flags, "-u")) {
+			dopts.user_agent = *ua;
+		}
+		else {
+			dopts.user_agent = ugconv::default_user_agent;
+		}
+		
+		if (auto s = find(opts.flags, "-s")) {
+			dopts.session_id = *s;
+		}
+		
+		if (auto m = find(opts.flags, "-metrics")) {
+			dopts.metrics_path = *m;
+		}
+		
+		return run_daemon(dopts);
+	}
+	
+	auto scratch_pool = make_scratch_pool(scratch, scratch_cap);
+	
 	ugconv::context ctx;
+	set_limits(ctx, timeout, stall);
+	ctx.set_scratch_pool(scratch_pool.get());
 	
 	if (opts.flags.contains("-v")) {
 		ctx.print_commands = true;
@@ -205,23 +359,20 @@ int main(int argc, char **argv) {
 	
 	auto fmt = determine_format(out, find(opts.flags, "-fmt"));
 	
-	if (out.empty() || fs::is_directory(out)) {
-		auto ext = ugconv::extension(fmt);
-		fs::path name;
+	out = output_path(std::move(out), fmt, ctx.post_id());
+	
+	ugconv::manifest index;
+	bool revalidate = opts.flags.contains("-revalidate");
+	
+	if (revalidate || opts.flags.contains("-incremental")) {
+		auto path = out.parent_path() / ugconv::manifest::default_name;
 		
-		if (auto pid = ctx.post_id()) {
-			name = std::to_string(*pid) + '.' + ext;
-		}
-		else {
-			name = "out." + ext;
+		if (!index.open(path)) {
+			std::cout << "Failed to open manifest " << path << '\n';
+			return 1;
 		}
 		
-		if (fs::is_directory(out)) {
-			out /= std::move(name);
-		}
-		else {
-			out = std::move(name);
-		}
+		ctx.set_manifest(&index, revalidate);
 	}
 	
 	std::string progbar_msg;
@@ -242,8 +393,31 @@ int main(int argc, char **argv) {
 	
 	ctx.show_progress(!opts.flags.contains("-q"));
 	
-	if (auto res = ctx.convert(out, fmt); !res) {
+	metrics_log mlog;
+	
+	if (auto m = find(opts.flags, "-metrics"); m && !mlog.open(*m)) {
+		std::cout << "Failed to open metrics file " << *m << '\n';
+		return 1;
+	}
+	
+	// Ctrl-C cancels the conversion so the temp dir and partial output are cleaned up.
+	std::stop_source stop;
+	stop_on_signal(stop);
+	ctx.set_stop_token(stop.get_token());
+	
+	auto post_id = ctx.post_id();
+	auto res = ctx.convert(out, fmt);
+	
+	if (mlog) {
+		mlog.write(metrics_record(ctx.metrics(), res, post_id, out, fmt));
+	}
+	
+	if (!res) {
 		std::cout << res.message << '\n';
 		return 1;
 	}
+	
+	if (res.up_to_date && !opts.flags.contains("-q")) {
+		std::cout << out.string() << " is up to date\n";
+	}
 }